@@ -0,0 +1,140 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+
+#pragma once
+
+/* Arena hands out objects by 32-bit index. Storage grows in chunks of
+ * doubling size (2^BASE, 2^(BASE+1), ...) so elements never move and
+ * pointers into the arena stay valid while it grows. Index 0 is the
+ * first element allocated. The first chunks may be borrowed memory, 
+ * such as a mapped file. Chunks come zeroed from calloc, so T must be 
+ * all zero bytes when value-initialized; the pages of a fresh chunk 
+ * only take memory once they are used. */
+template<typename T, int BASE = 8>
+class Arena{
+	static_assert(std::is_trivially_copyable<T>::value, "Arena elements are raw memory");
+	public:
+		Arena() : _size(0), _cap(0), _grown(nullptr){}
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+
+		T& operator[](uint32_t i){
+			uint32_t j = i + (1u << BASE);
+			int k = 31 - __builtin_clz(j) - BASE;
+			return _chunks[k][j - (1u << (k+BASE))];
+		}
+
+		const T& operator[](uint32_t i) const{
+			return const_cast<Arena&>(*this)[i];
+		}
+
+		/* Allocate a value-initialized element, returns its index */
+		uint32_t alloc(){
+			if(_size == _cap){
+				std::size_t n = (std::size_t)1 << (_chunks.size() + BASE);
+				T* chunk = (T*)std::calloc(n, sizeof(T));
+				if(!chunk){
+					throw std::bad_alloc();
+				}
+				_owned.emplace_back(chunk);
+				_chunks.push_back(chunk);
+				_cap += n;
+				if(_grown){
+					*_grown += n*sizeof(T);
+				}
+			}
+			return _size++;
+		}
+
+		/* Number of elements in the chunks holding the first n */
+		static std::size_t capacity(uint32_t n){
+			std::size_t cap = 0;
+			for(int k = 0; cap < n; ++k){
+				cap += (std::size_t)1 << (k + BASE);
+			}
+			return cap;
+		}
+
+		/* Take the n elements at data as the contents of an empty arena.
+		 * data must have room for capacity(n) elements and outlive the 
+		 * arena's use of it. */
+		void borrow(T* data, uint32_t n){
+			while(_cap < n){
+				_chunks.push_back(data + _cap);
+				_cap += (std::size_t)1 << (_chunks.size() - 1 + BASE);
+			}
+			_size = n;
+		}
+
+		/* Call f(elements, count) on the used part of each chunk in order */
+		template<typename F>
+		void each_chunk(F f) const{
+			uint32_t left = _size;
+			for(std::size_t k=0; k<_chunks.size() && left > 0; ++k){
+				uint32_t n = std::min<uint32_t>(left, 1u << (k + BASE));
+				f((const T*)_chunks[k], n);
+				left -= n;
+			}
+		}
+
+		uint32_t size() const{ return _size; }
+
+		/* Add the bytes of every chunk allocated from now on to *grown, 
+		 * so an owner can watch its memory without polling. It stays 
+		 * with the arena on swap. */
+		void meter(std::size_t* grown){ _grown = grown; }
+
+		/* Bytes reserved by the chunks */
+		std::size_t bytes() const{ return (std::size_t)_cap*sizeof(T); }
+
+		void clear(){
+			_chunks.clear();
+			_owned.clear();
+			_size = _cap = 0;
+		}
+
+		void swap(Arena &o){
+			_chunks.swap(o._chunks);
+			_owned.swap(o._owned);
+			std::swap(_size, o._size);
+			std::swap(_cap, o._cap);
+		}
+
+	private:
+		std::vector<T*> _chunks;
+		struct Free{
+			void operator()(T* p) const{ std::free(p); }
+		};
+		std::vector<std::unique_ptr<T, Free>> _owned; // the chunks not borrowed
+		uint32_t _size, _cap;
+		std::size_t* _grown;
+};
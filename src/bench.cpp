@@ -0,0 +1,325 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+/* ctwz_bench runs the ctwz executable over every file of a corpus
+ * directory at several depths, checks the round trip and reports size,
+ * bits per byte, throughput and peak memory as CSV or JSON. With a 
+ * baseline CSV from an earlier run it flags regressions. */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+#include <iterator>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <map>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+namespace fs = std::filesystem;
+
+struct Result{
+	std::string file;
+	int depth = 0;
+	long long size = 0, compressed = 0;
+	double enc_mbps = 0, dec_mbps = 0;
+	long enc_rss = 0, dec_rss = 0; // KiB
+	bool ok = false;
+	double bpb() const{ return size ? 8.0*compressed/size : 0; }
+};
+
+struct Run{
+	bool ok = false;
+	double seconds = 0;
+	long rss = 0; // KiB
+};
+
+/* Run a command with stdout sent to `out`, measuring its wall time
+ * and peak resident memory */
+Run run(const std::vector<std::string> &args, const std::string &out){
+	Run r;
+	auto start = std::chrono::steady_clock::now();
+	pid_t pid = fork();
+	if(pid < 0){
+		return r;
+	}
+	if(pid == 0){
+		int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		int null = open("/dev/null", O_RDONLY);
+		if(fd < 0 || null < 0){
+			_exit(127);
+		}
+		dup2(fd, 1);
+		dup2(null, 0);
+		std::vector<char*> argv;
+		for(const std::string &a : args){
+			argv.push_back(const_cast<char*>(a.c_str()));
+		}
+		argv.push_back(nullptr);
+		execv(argv[0], argv.data());
+		_exit(127);
+	}
+	int status;
+	struct rusage ru;
+	if(wait4(pid, &status, 0, &ru) < 0){
+		return r;
+	}
+	r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	r.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	r.rss = ru.ru_maxrss;
+	return r;
+}
+
+bool same_contents(const fs::path &a, const fs::path &b){
+	if(fs::file_size(a) != fs::file_size(b)){
+		return false;
+	}
+	std::ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+	return std::equal(std::istreambuf_iterator<char>(fa), std::istreambuf_iterator<char>(),
+		std::istreambuf_iterator<char>(fb));
+}
+
+/* The options of opts that the decoder takes too: the dictionary and 
+ * the threads */
+std::vector<std::string> decode_opts(const std::vector<std::string> &opts){
+	std::vector<std::string> dec;
+	for(std::size_t i=0; i+1<opts.size(); ++i){
+		if(opts[i] == "-D" || opts[i] == "-j"){
+			dec.push_back(opts[i]);
+			dec.push_back(opts[++i]);
+		}
+	}
+	return dec;
+}
+
+Result bench(const std::string &ctwz, const fs::path &file, int depth,
+		const std::vector<std::string> &opts, const fs::path &tmp){
+	Result res;
+	res.file = file.filename().string();
+	res.depth = depth;
+	res.size = fs::file_size(file);
+	//ctwz writes file.cz next to its input, so code a link in tmp
+	fs::path in = tmp / file.filename();
+	fs::path cz = in.string() + ".cz";
+	fs::path out = in.string() + ".out";
+	fs::remove(in);
+	fs::create_symlink(fs::absolute(file), in);
+	std::vector<std::string> args = {ctwz, "-d", std::to_string(depth)};
+	args.insert(args.end(), opts.begin(), opts.end());
+	args.push_back(in.string());
+	Run enc = run(args, "/dev/null");
+	if(enc.ok){
+		std::vector<std::string> dargs = {ctwz, "-x", "-c"};
+		std::vector<std::string> dopts = decode_opts(opts);
+		dargs.insert(dargs.end(), dopts.begin(), dopts.end());
+		dargs.push_back(cz.string());
+		Run dec = run(dargs, out.string());
+		res.compressed = fs::file_size(cz);
+		res.enc_mbps = res.size/1e6/enc.seconds;
+		res.dec_mbps = res.size/1e6/dec.seconds;
+		res.enc_rss = enc.rss;
+		res.dec_rss = dec.rss;
+		res.ok = dec.ok && same_contents(file, out);
+	}
+	fs::remove(in);
+	fs::remove(cz);
+	fs::remove(out);
+	return res;
+}
+
+const char* CSV_HEADER = "file,depth,size,compressed,bpb,enc_mbps,dec_mbps,enc_rss_kib,dec_rss_kib,ok";
+
+void write_csv(std::ostream &os, const std::vector<Result> &results){
+	os << CSV_HEADER << "\n";
+	for(const Result &r : results){
+		os << r.file << "," << r.depth << "," << r.size << "," << r.compressed << "," 
+			<< r.bpb() << "," << r.enc_mbps << "," << r.dec_mbps << ","
+			<< r.enc_rss << "," << r.dec_rss << "," << r.ok << "\n";
+	}
+}
+
+void write_json(std::ostream &os, const std::vector<Result> &results){
+	os << "[\n";
+	for(std::size_t i=0; i<results.size(); ++i){
+		const Result &r = results[i];
+		os << "  {\"file\": \"" << r.file << "\", \"depth\": " << r.depth 
+			<< ", \"size\": " << r.size << ", \"compressed\": " << r.compressed 
+			<< ", \"bpb\": " << r.bpb() << ", \"enc_mbps\": " << r.enc_mbps 
+			<< ", \"dec_mbps\": " << r.dec_mbps << ", \"enc_rss_kib\": " << r.enc_rss 
+			<< ", \"dec_rss_kib\": " << r.dec_rss << ", \"ok\": " << (r.ok ? "true" : "false")
+			<< "}" << (i+1 < results.size() ? "," : "") << "\n";
+	}
+	os << "]\n";
+}
+
+std::vector<Result> read_csv(const std::string &path){
+	std::ifstream is(path);
+	if(!is.is_open()){
+		throw std::runtime_error("Can't open baseline " + path);
+	}
+	std::vector<Result> results;
+	std::string line;
+	std::getline(is, line);
+	while(std::getline(is, line)){
+		std::replace(line.begin(), line.end(), ',', ' ');
+		std::istringstream ls(line);
+		Result r;
+		double bpb;
+		ls >> r.file >> r.depth >> r.size >> r.compressed >> bpb 
+			>> r.enc_mbps >> r.dec_mbps >> r.enc_rss >> r.dec_rss >> r.ok;
+		if(ls){
+			results.push_back(r);
+		}
+	}
+	return results;
+}
+
+/* Report results that got bigger, slower or hungrier than the baseline 
+ * by more than `tol` percent. Returns the number of regressions. */
+int compare(const std::vector<Result> &results, const std::vector<Result> &base, double tol){
+	std::map<std::pair<std::string,int>, Result> old;
+	for(const Result &r : base){
+		old[{r.file, r.depth}] = r;
+	}
+	int bad = 0;
+	auto flag = [&](const Result &r, const char* what, double was, double is){
+		std::cerr << "REGRESSION " << r.file << " depth " << r.depth << ": " 
+			<< what << " " << was << " -> " << is << std::endl;
+		++bad;
+	};
+	double f = tol/100;
+	for(const Result &r : results){
+		if(!r.ok){
+			std::cerr << "FAILED " << r.file << " depth " << r.depth << std::endl;
+			++bad;
+		}
+		auto it = old.find({r.file, r.depth});
+		if(it == old.end()){
+			continue;
+		}
+		const Result &o = it->second;
+		if(r.compressed > o.compressed*(1+f)){
+			flag(r, "compressed", o.compressed, r.compressed);
+		}
+		if(r.enc_mbps < o.enc_mbps*(1-f)){
+			flag(r, "encode MB/s", o.enc_mbps, r.enc_mbps);
+		}
+		if(r.dec_mbps < o.dec_mbps*(1-f)){
+			flag(r, "decode MB/s", o.dec_mbps, r.dec_mbps);
+		}
+		if(r.enc_rss > o.enc_rss*(1+f)){
+			flag(r, "encode RSS KiB", o.enc_rss, r.enc_rss);
+		}
+	}
+	return bad;
+}
+
+void usage(){
+	std::cout << "ctwz_bench:\n"
+		<< "\tBenchmark ctwz over a corpus directory\n"
+		<< "usage:\n" 
+		<< "\tctwz_bench [-d 4,8,12] [-o \"ctwz options\"] [-b ctwz] [--json]\n"
+		<< "\t           [--compare baseline.csv [-t percent]] corpus_dir" << std::endl;
+	exit(0);
+}
+
+int main(int argc, char* argv[]){
+	std::vector<int> depths = {4, 8, 12};
+	std::vector<std::string> opts;
+	std::string ctwz = (fs::path(argv[0]).parent_path() / "ctwz").string();
+	std::string baseline;
+	double tol = 5;
+	bool json = false;
+	char* corpus = nullptr;
+	for(int i=1; i<argc; ++i){
+		if(strcmp(argv[i],"-d")==0 && i+1<argc){
+			depths.clear();
+			std::istringstream ds(argv[++i]);
+			std::string d;
+			while(std::getline(ds, d, ',')){
+				depths.push_back(atoi(d.c_str()));
+			}
+		}else if(strcmp(argv[i],"-o")==0 && i+1<argc){
+			std::istringstream os(argv[++i]);
+			std::string o;
+			while(os >> o){
+				opts.push_back(o);
+			}
+		}else if(strcmp(argv[i],"-b")==0 && i+1<argc){
+			ctwz = argv[++i];
+		}else if(strcmp(argv[i],"-t")==0 && i+1<argc){
+			tol = atof(argv[++i]);
+		}else if(strcmp(argv[i],"--compare")==0 && i+1<argc){
+			baseline = argv[++i];
+		}else if(strcmp(argv[i],"--json")==0){
+			json = true;
+		}else if(argv[i][0] != '-' && corpus == nullptr){
+			corpus = argv[i];
+		}else{
+			usage();
+		}
+	}
+	if(corpus == nullptr){
+		usage();
+	}
+	std::vector<fs::path> files;
+	for(const auto &e : fs::directory_iterator(corpus)){
+		if(e.is_regular_file() && e.path().extension() != ".cz"){
+			files.push_back(e.path());
+		}
+	}
+	std::sort(files.begin(), files.end());
+
+	fs::path tmp = fs::temp_directory_path() / ("ctwz_bench." + std::to_string(getpid()));
+	fs::create_directories(tmp);
+	std::vector<Result> results;
+	for(int depth : depths){
+		for(const fs::path &f : files){
+			results.push_back(bench(ctwz, f, depth, opts, tmp));
+			const Result &r = results.back();
+			std::cerr << r.file << " depth " << depth << ": " << r.compressed 
+				<< " bytes, " << r.bpb() << " bpb, " << r.enc_mbps << "/" 
+				<< r.dec_mbps << " MB/s" << (r.ok ? "" : " FAILED") << std::endl;
+		}
+	}
+	fs::remove_all(tmp);
+	if(json){
+		write_json(std::cout, results);
+	}else{
+		write_csv(std::cout, results);
+	}
+	int bad = 0;
+	if(!baseline.empty()){
+		bad = compare(results, read_csv(baseline), tol);
+	}else{
+		for(const Result &r : results){
+			bad += !r.ok;
+		}
+	}
+	return bad ? 1 : 0;
+}
@@ -57,7 +57,7 @@ public:
     typedef typename Queue::const_reference     const_reference;
 
     ConcurrentQueue(size_type max_size = std::numeric_limits<size_t>::max()):
-        max_size(max_size), is_shutdown_flag(false), is_terminated_flag(false)
+        is_shutdown_flag(false), is_terminated_flag(false), max_size(max_size)
     {
         if (max_size == 0) {
             throw std::invalid_argument("queue max size is 0");
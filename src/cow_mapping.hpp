@@ -0,0 +1,87 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <stdexcept>
+#include <cstddef>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#pragma once
+
+/* Private writable memory of `size` bytes that starts with the `n` 
+ * bytes of the file at `offset`, and zeros after them. Where `offset` 
+ * is page aligned the file is mapped copy-on-write, so only pages that
+ * get written are copied; otherwise it is read in. */
+class CowMapping{
+	public:
+		CowMapping(int fd, off_t offset, std::size_t n, std::size_t size) : 
+			_data(nullptr), _size(size){
+			if(size == 0){
+				return;
+			}
+			void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, 
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(p == MAP_FAILED){
+				throw std::runtime_error("Out of memory");
+			}
+			_data = (char*)p;
+			if(n == 0){
+				return;
+			}
+			//whole pages are mapped, the partial last page is read
+			std::size_t page = sysconf(_SC_PAGESIZE);
+			std::size_t done = 0;
+			if(offset % page == 0 && n >= page){
+				done = n / page * page;
+				if(mmap(p, done, PROT_READ | PROT_WRITE, 
+						MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED){
+					done = 0;
+				}
+			}
+			while(done < n){
+				ssize_t r = pread(fd, _data + done, n - done, offset + done);
+				if(r <= 0){
+					if(r < 0 && errno == EINTR){
+						continue;
+					}
+					munmap(_data, _size);
+					throw std::runtime_error("Can't read dictionary");
+				}
+				done += r;
+			}
+		}
+		CowMapping(const CowMapping&) = delete;
+		CowMapping& operator=(const CowMapping&) = delete;
+		~CowMapping(){
+			if(_data){
+				munmap(_data, _size);
+			}
+		}
+
+		char* data(){ return _data; }
+
+	private:
+		char* _data;
+		std::size_t _size;
+};
@@ -1,183 +1,1054 @@
 #include "ctw.hpp"
-const double BETA_MAX = DBL_MAX/16;
+#include <algorithm>
+#include <functional>
+#include <cctype>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+const int32_t LBETA_MAX = 16 << 16; // bound on |log2 beta|, Q16
+const int SQUASH_MAX = LBETA_MAX >> 8;
 
-double KT_estimator(bool obs, int n0, int n1){
-	static std::unordered_map<int,double> _cache;
-	int c = obs? n1 : n0;
-	int h = ((n0 + n1)<<8) + c; 
-	if( _cache.count(h) == 0){
-		_cache[h] = ((double)c+0.0625)/((double)n0+n1+0.125);
+/* Integer tables for the CTW kernel. They are built with integer 
+ * arithmetic only, so every machine computes the same model. */
+struct Tables{
+	uint16_t kt[256][256]; // KT estimate of Pr(1) after a zeros and b ones
+	uint16_t log_frac[1 << 12]; // log2(1 + m/4096) in Q16
+	uint16_t squash[2*SQUASH_MAX+1]; // weight of a node with log2 beta = i-SQUASH_MAX in Q8
+	Tables();
+};
+
+const Tables TABLES;
+
+/* log2(x) in Q16 for 0 < x < 2^16 */
+inline int32_t log2_q16(uint32_t x){
+	int e = 31 - __builtin_clz(x);
+	uint32_t m = ((x << (31-e)) >> 19) & 0xfff;
+	return (e << 16) + TABLES.log_frac[m];
+}
+
+Tables::Tables(){
+	for(int a=0; a<256; ++a){
+		for(int b=0; b<256; ++b){
+			//(b + 1/16)/(a + b + 1/8)
+			int p = ((int64_t)(16*b+1) << PROB_BITS)/(16*(a+b)+2);
+			kt[a][b] = std::min(std::max(p,1), PROB_ONE-1);
+		}
+	}
+	//bit by bit by squaring the mantissa in Q30
+	for(int m=0; m < (1 << 12); ++m){
+		uint64_t y = (uint64_t)((1 << 12) + m) << 18;
+		uint32_t l = 0;
+		for(int i=15; i>=0; --i){
+			y = (y*y) >> 30;
+			if(y >= (1ull << 31)){
+				l |= 1 << i;
+				y >>= 1;
+			}
+		}
+		log_frac[m] = l;
+	}
+	//invert the stretch log2(p/(1-p)), which is increasing in p
+	uint32_t p = 1;
+	for(int i=0; i<2*SQUASH_MAX+1; ++i){
+		int32_t d = (i - SQUASH_MAX) * 256;
+		while(p < PROB_ONE-1 && log2_q16(p) - log2_q16(PROB_ONE-p) < d){
+			++p;
+		}
+		squash[i] = p;
 	}
-	return _cache[h];
 }
 
-ContextTree::ContextTree(std::size_t depth):_depth(depth){
-	_root = std::make_unique<Node>(); 
+ContextTree::ContextTree(std::size_t depth, int grow):
+	_depth(depth), _grow(grow), _table(nullptr), _seed(0){
+	_nodes.alloc(); // root
+	_select_kernel();
 }
 
-void ContextTree::update(bool b, const std::deque<char> &ctx,
-		double _probs[], double _betas[], Node* _path[]){
-	Node* n = _root.get();
-	for(int i=0; i<_depth; ++i){
-		_path[i] = n;
-		n = n->get_child(ctx[i]);
+ContextTree::ContextTree(std::size_t depth, int grow, HashTable* table, uint64_t seed):
+	_depth(depth), _grow(grow), _table(table), _seed(seed){
+	_select_kernel();
+}
+
+/* Count an observation, halving the counts before they overflow */
+inline void observe(ContextTree::Stats* n, bool b){
+	n->a += !b;
+	n->b += b;
+	if( ((n->a)>=128 && (n->b)>=128) 
+		|| (n->a) >= 255 
+		|| (n->b)>=255){
+		n->a /= 2;
+		n->b /= 2;
+		STATS(++stats::local().rescales);
+	} 
+}
+
+/* Hash of the context extended by one symbol */
+inline uint64_t hash_step(uint64_t h, char c){
+	h = (h + (uint8_t)c + 1)*0x9E3779B97F4A7C15ULL;
+	return h ^ (h >> 29);
+}
+
+/* Hash of the context of the i most recent bytes in the tree `seed` */
+inline uint64_t context_hash(const ContextBuffer &ctx, int i, uint64_t seed){
+	return hash_step(ctx.hash(i) + seed*0x9E3779B97F4A7C15ULL, i);
+}
+
+/* Hash the contexts of a path in the tree `seed` and start loading 
+ * their buckets, which then arrive in parallel instead of one by one */
+inline void prefetch_path(const HashTable &table, const ContextBuffer &ctx, int depth, 
+		uint64_t seed, uint64_t h[]){
+	for(int i=0; i<depth; ++i){
+		h[i] = context_hash(ctx, i, seed);
+		table.prefetch(h[i]);
 	}
-	//calculate probabilites
-	for(int i = _depth-1; i>=0; --i){
+}
+
+/* The CTW kernel on a context path from the root, _path[0], to the 
+ * leaf, _path[depth-1]: sets the probabilities of both outcomes at 
+ * every node and the log betas after either outcome. The path is only
+ * read, observe_path applies the outcome once it is known. D is the 
+ * depth, or 0 to use `depth`. */
+template<int D>
+void weigh(int depth, int _probs[], int32_t _betas[], ContextTree::Stats* const _path[]){
+	depth = D ? D : depth;
+	//calculate probabilites, the leaf has only its estimate
+	const ContextTree::Stats* n = _path[depth-1];
+	_probs[2*(depth-1)+1] = TABLES.kt[n->a][n->b];
+	_probs[2*(depth-1)] = PROB_ONE - _probs[2*(depth-1)+1];
+#pragma GCC unroll 16
+	for(int i = depth-2; i>=0; --i){
 		n = _path[i];
-		if(i == _depth-1){
-			_probs[2*i] = KT_estimator(0,n->a,n->b);
-			_probs[2*i+1] = KT_estimator(1,n->a,n->b); 
-		}else if(n->beta < BETA_MAX){ 
-			/* beta = KT_estimate(b|x_1..x_n) divided by 
-			* product over children's probs Pr(b|x_1,...x_n)*/
-			n->beta /= n->a + n->b + 0.125;
-			_betas[2*i] = (n->beta)*(n->a + 0.0625);
-			_betas[2*i+1] = (n->beta)*(n->b + 1);
-			double eta_0 = _betas[2*i] + _probs[2*(i+1)];
-			double eta_1 = _betas[2*i+1] + _probs[2*(i+1)+1];
-			_probs[2*i] = eta_0/(eta_0 + eta_1);
-			_probs[2*i+1] = eta_1/(eta_0 + eta_1);
-			n->beta = _betas[2*i+b]/(_probs[2*(i+1)+b]);
-		}else{
-			n->beta = 1.0; 
+		/* beta = KT estimate divided by the children's weighted 
+		 * probability, weighting gives the node's estimate 
+		 * beta/(beta+1) of the mix */
+		int pe = TABLES.kt[n->a][n->b];
+		int pc = _probs[2*(i+1)+1];
+		int lb = std::min(std::max(n->lbeta >> 8, -SQUASH_MAX), SQUASH_MAX);
+		int w = TABLES.squash[lb + SQUASH_MAX];
+		_probs[2*i+1] = pc + (((int64_t)(pe - pc)*w) >> PROB_BITS);
+		_probs[2*i] = PROB_ONE - _probs[2*i+1];
+		int32_t lb0 = n->lbeta + log2_q16(PROB_ONE-pe) - log2_q16(PROB_ONE-pc);
+		int32_t lb1 = n->lbeta + log2_q16(pe) - log2_q16(pc);
+		_betas[2*i] = std::min(std::max(lb0, -LBETA_MAX), LBETA_MAX);
+		_betas[2*i+1] = std::min(std::max(lb1, -LBETA_MAX), LBETA_MAX);
+	}
+}
+
+/* Update a path weighed by weigh with outcome b */
+template<int D>
+void observe_path(bool b, int depth, const int32_t _betas[], ContextTree::Stats* _path[]){
+	depth = D ? D : depth;
+	observe(_path[depth-1], b);
+#pragma GCC unroll 16
+	for(int i = 0; i < depth-1; ++i){
+		_path[i]->lbeta = _betas[2*i+b];
+		observe(_path[i], b);
+	}
+}
+
+template<int D>
+int ContextTree::_predict(const ContextBuffer &ctx,
+		int _probs[], int32_t _betas[], Stats* _path[]){
+	const int depth = D ? D : _depth;
+	int len = 0;
+	if(_table){
+		uint64_t h[MAX_DEPTH];
+		prefetch_path(*_table, ctx, depth, _seed, h);
+		Stats* s;
+		do{
+			s = _table->find(h[len]);
+			_path[len++] = s;
+		}while(len < depth && s->a + s->b >= _grow);
+	}else{
+		Node* n = &_nodes[0];
+		_path[len++] = n;
+		while(len < depth && n->a + n->b >= _grow){
+			n = get_child(n, ctx[len-1]);
+			_path[len++] = n;
 		}
-		if(b){ ++(n->b); }else{ ++(n->a); }
-		if( ((n->a)>=128 && (n->b)>=128) 
-			|| (n->a) >= 255 
-			|| (n->b)>=255){
-			n->a /= 2;
-			n->b /= 2;
-		} 
 	}
+	if(len == depth){
+		weigh<D>(depth, _probs, _betas, _path);
+	}else{
+		weigh<0>(len, _probs, _betas, _path);
+	}
+	return len;
 }
 
-void ContextTree::reupdate(bool b, 
-		double _probs[], double _betas[], Node* _path[]){
-	//correct dummy update
-	int i = 0;
-	while(i < _depth && _path[i] != nullptr){
-		if(b){
-			--(_path[i]->a);
-			++(_path[i]->b);
-		}else{
-			--(_path[i]->b);
-			++(_path[i]->a);
+void ContextTree::_select_kernel(){
+	switch(_depth){
+		case 8:
+			_predict_fn = &ContextTree::_predict<8>;
+			_commit_fn = &observe_path<8>;
+			break;
+		case 12:
+			_predict_fn = &ContextTree::_predict<12>;
+			_commit_fn = &observe_path<12>;
+			break;
+		case 16:
+			_predict_fn = &ContextTree::_predict<16>;
+			_commit_fn = &observe_path<16>;
+			break;
+		case 32:
+			_predict_fn = &ContextTree::_predict<32>;
+			_commit_fn = &observe_path<32>;
+			break;
+		default:
+			_predict_fn = &ContextTree::_predict<0>;
+			_commit_fn = &observe_path<0>;
+	}
+}
+
+int ContextTree::predict(const ContextBuffer &ctx,
+		int _probs[], int32_t _betas[], Stats* _path[]){
+	STATS(stats::Timer t(stats::local().predict_ns));
+	return (this->*_predict_fn)(ctx, _probs, _betas, _path);
+}
+
+void ContextTree::commit(bool b, int len, const int32_t _betas[], Stats* _path[]){
+	STATS(stats::Timer t(stats::local().commit_ns); ++stats::local().updates);
+	if(len == _depth){
+		_commit_fn(b, len, _betas, _path);
+	}else{
+		observe_path<0>(b, len, _betas, _path);
+	}
+}
+
+void ContextTree::prefetch(const ContextBuffer &ctx) const{
+	if(_table){
+		uint64_t h[MAX_DEPTH];
+		prefetch_path(*_table, ctx, _depth, _seed, h);
+	}
+}
+
+/* Find or create the item keyed c of a list that starts at `head` and
+ * has `count` items, most recently used first. Past DENSE_KIDS items 
+ * the list is moved to a 256-way table and count becomes DENSE. Item 0
+ * of the arena is never listed, so 0 ends a list. */
+template<typename T, typename K>
+uint32_t find_or_add(Arena<T> &items, Arena<ContextTree::Table,0> &tables, 
+		uint32_t &head, uint8_t &count, K T::*key, K c){
+	if(count == ContextTree::DENSE){
+		uint32_t &slot = tables[head].child[(uint8_t)c];
+		if(slot == 0){
+			slot = items.alloc(); 
+			items[slot].*key = c;
 		}
-		if(!_path[i]->is_leaf()){
-			_path[i]->beta = _betas[2*i+b]/_probs[2*(i+1)+b];
-		}else{
+		return slot;
+	}
+	uint32_t prev = 0;
+	for(uint32_t i = head; i != 0; prev = i, i = items[i].next){
+		T* m = &items[i];
+		if(m->*key == c){
+			if(prev != 0){
+				items[prev].next = m->next;
+				m->next = head;
+				head = i;
+			}
+			return i;
+		}
+	}
+	uint32_t k = items.alloc();
+	T* m = &items[k];
+	m->*key = c;
+	if(count < ContextTree::DENSE_KIDS){
+		m->next = head;
+		head = k;
+		++count;
+		return k;
+	}
+	//too many for a list, move them to a table
+	uint32_t t = tables.alloc();
+	ContextTree::Table &tab = tables[t];
+	for(uint32_t i = head; i != 0; i = items[i].next){
+		tab.child[(uint8_t)(items[i].*key)] = i;
+	}
+	tab.child[(uint8_t)c] = k;
+	head = t;
+	count = ContextTree::DENSE;
+	return k;
+}
+
+/* The items of a list in list order, or of a table in key order */
+template<typename T>
+std::vector<uint32_t> list_items(const Arena<T> &items, const Arena<ContextTree::Table,0> &tables,
+		uint32_t head, uint8_t count){
+	std::vector<uint32_t> out;
+	if(count == ContextTree::DENSE){
+		for(int c=0; c<256; ++c){
+			uint32_t i = tables[head].child[c];
+			if(i != 0){
+				out.push_back(i);
+			}
+		}
+	}else{
+		for(uint32_t i = head; i != 0; i = items[i].next){
+			out.push_back(i);
+		}
+	}
+	return out;
+}
+
+/* Link new items into a list, or a table if there are too many */
+template<typename T, typename K>
+void link_items(Arena<T> &items, Arena<ContextTree::Table,0> &tables,
+		const std::vector<uint32_t> &keep, uint32_t &head, uint8_t &count, K T::*key){
+	if(keep.size() > ContextTree::DENSE_KIDS){
+		uint32_t t = tables.alloc();
+		for(uint32_t i : keep){
+			tables[t].child[(uint8_t)(items[i].*key)] = i;
+		}
+		head = t;
+		count = ContextTree::DENSE;
+	}else{
+		for(auto i = keep.rbegin(); i != keep.rend(); ++i){
+			items[*i].next = head;
+			head = *i;
+		}
+		count = keep.size();
+	}
+}
+
+/* Find or create the child of n for context symbol c */
+ContextTree::Node* ContextTree::get_child(Node* n, char c){
+	return &_nodes[find_or_add(_nodes, _tables, n->child, n->kids, &Node::sym, c)];
+}
+
+/* Drop the subtrees that don't pay for themselves: the children of 
+ * nodes whose own estimate did better than their children (beta >= 1)
+ * and contexts seen fewer than min_count times. Surviving nodes are 
+ * copied to fresh arenas, so the tree must not be in use. */
+void ContextTree::prune(int min_count){
+	if(_table){
+		return;
+	}
+	Arena<Node> nodes;
+	Arena<Table,0> tables;
+	_copy(_nodes[0], 0, min_count, nodes, tables);
+	_nodes.swap(nodes);
+	_tables.swap(tables);
+}
+
+uint32_t ContextTree::_copy(const Node &n, int level, int min_count,
+		Arena<Node> &nodes, Arena<Table,0> &tables) const{
+	uint32_t k = nodes.alloc();
+	Node &m = nodes[k];
+	static_cast<Stats&>(m) = n;
+	m.sym = n.sym;
+	if(n.kids == 0 || level == _depth-1 || n.lbeta >= 0){
+		return k;
+	}
+	std::vector<uint32_t> keep;
+	for(uint32_t i : list_items(_nodes, _tables, n.child, n.kids)){
+		if(_nodes[i].a + _nodes[i].b >= min_count){
+			keep.push_back(_copy(_nodes[i], level+1, min_count, nodes, tables));
+		}
+	}
+	link_items(nodes, tables, keep, m.child, m.kids, &Node::sym);
+	return k;
+}
+
+/* Forget everything, as a fresh tree */
+void ContextTree::clear(){
+	if(_table){
+		return;
+	}
+	_nodes.clear();
+	_tables.clear();
+	_nodes.alloc();
+}
+
+HashTable::HashTable(std::size_t mib) : _now(0){
+	//largest power of two number of buckets that fits
+	std::size_t buckets = 1;
+	while(2*buckets*sizeof(Bucket) <= (mib << 20)){
+		buckets *= 2;
+	}
+	_buckets.resize(buckets);
+	_shift = 64 - __builtin_ctzll(buckets);
+}
+
+ContextTree::Stats* HashTable::find(uint64_t h){
+	uint16_t check = (h >> 16) | 1;
+	Slot* bucket = _buckets[_bucket(h)].slots;
+	Slot* victim = nullptr;
+	for(int i=0; i<WAYS; ++i){
+		Slot* s = bucket+i;
+		if(s->check == check){
+			s->stamp = _now;
+			return s;
+		}
+		if(s->stamp == _now && s->check != 0){
+			continue; // in use by the current byte
+		}
+		if(victim == nullptr || s->check == 0 
+			|| (victim->check != 0 && 
+				(s->a + s->b < victim->a + victim->b 
+				|| (s->a + s->b == victim->a + victim->b 
+					&& _now - s->stamp > _now - victim->stamp)))){
+			victim = s;
+		}
+	}
+	if(victim == nullptr){
+		//every slot is on a live path, use a throwaway one
+		victim = &_spill;
+	}
+	*victim = Slot();
+	victim->check = check;
+	victim->stamp = _now;
+	return victim;
+}
+
+void ContextTree::meter(std::size_t* grown){
+	_nodes.meter(grown);
+	_tables.meter(grown);
+}
+
+/* Add the number of nodes at each depth to per_depth */
+void ContextTree::census(std::vector<uint64_t> &per_depth) const{
+	if(_table){
+		return;
+	}
+	if(per_depth.size() < _depth){
+		per_depth.resize(_depth);
+	}
+	_census(_nodes[0], 0, per_depth);
+}
+
+void ContextTree::_census(const Node &n, int level, std::vector<uint64_t> &per_depth) const{
+	++per_depth[level];
+	if(n.kids == DENSE){
+		for(int c=0; c<256; ++c){
+			uint32_t i = _tables[n.child].child[c];
+			if(i != 0){
+				_census(_nodes[i], level+1, per_depth);
+			}
+		}
+	}else{
+		for(uint32_t i = n.child; i != 0; i = _nodes[i].next){
+			_census(_nodes[i], level+1, per_depth);
+		}
+	}
+}
+
+std::size_t ContextTree::size() const{
+	return _nodes.size();
+}
+
+std::size_t ContextTree::bytes() const{
+	if(_table){
+		return 0; // accounted by the table
+	}
+	return _nodes.bytes() + _tables.bytes();
+}
+
+SharedContextTree::SharedContextTree(std::size_t depth, int grow):
+	_depth(depth), _grow(grow), _walk_len(0), _ctx(nullptr), _table(nullptr){
+	clear();
+	_select_kernel();
+}
+
+SharedContextTree::SharedContextTree(std::size_t depth, int grow, HashTable* table):
+	_depth(depth), _grow(grow), _walk_len(0), _ctx(nullptr), _table(table){
+	_select_kernel();
+}
+
+const char DICT_MAGIC[8] = {'C','T','W','Z','D','I','C','1'};
+
+SharedContextTree::SharedContextTree(std::size_t depth, int grow, const std::string &path):
+	_depth(depth), _grow(grow), _walk_len(0), _ctx(nullptr), _table(nullptr){
+	DictHeader h = read_dict(path);
+	if(h.depth != depth){
+		throw std::runtime_error("Dictionary " + path + " is for another depth");
+	}
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0){
+		throw std::runtime_error("Can't open dictionary " + path);
+	}
+	struct stat st;
+	off_t offset = DICT_ALIGN;
+	try{
+		if(fstat(fd, &st) < 0){
+			throw std::runtime_error("Can't read dictionary " + path);
+		}
+		//a mapping past the end of the file faults when it is touched
+		_map(fd, offset, st.st_size, h.nodes, _nodes);
+		_map(fd, offset, st.st_size, h.slots, _slots);
+		_map(fd, offset, st.st_size, h.tables, _tables);
+	}catch(...){
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+	_select_kernel();
+}
+
+SharedContextTree::DictHeader SharedContextTree::read_dict(const std::string &path){
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0){
+		throw std::runtime_error("Can't open dictionary " + path);
+	}
+	DictHeader h;
+	ssize_t r = pread(fd, &h, sizeof(h), 0);
+	::close(fd);
+	if(r != sizeof(h) || memcmp(h.magic, DICT_MAGIC, sizeof(h.magic)) != 0 
+		|| h.depth == 0 || h.depth > MAX_DEPTH || h.nodes == 0 || h.slots == 0){
+		throw std::runtime_error("Not a ctwz dictionary " + path);
+	}
+	return h;
+}
+
+/* Back the first n elements of an empty arena with the file at offset, 
+ * and move offset past them */
+template<typename T, int BASE>
+void SharedContextTree::_map(int fd, off_t &offset, off_t file_size, uint32_t n, Arena<T,BASE> &arena){
+	std::size_t size = n*sizeof(T);
+	if(offset + (off_t)size > file_size){
+		throw std::runtime_error("Dictionary is truncated");
+	}
+	_maps.push_back(std::make_unique<CowMapping>(fd, offset, size, 
+				Arena<T,BASE>::capacity(n)*sizeof(T)));
+	arena.borrow((T*)_maps.back()->data(), n);
+	offset += (size + DICT_ALIGN - 1)/DICT_ALIGN*DICT_ALIGN;
+}
+
+/* Write the model as a dictionary: the arenas are stored as they are
+ * in memory, padded with zeros to DICT_ALIGN, so a dictionary can be 
+ * mapped in place. It is only read on the machine type that wrote it. */
+void SharedContextTree::save(std::ostream &of) const{
+	if(_table){
+		throw std::runtime_error("Hashed models can't be saved");
+	}
+	DictHeader h = {};
+	memcpy(h.magic, DICT_MAGIC, sizeof(h.magic));
+	h.depth = _depth;
+	h.nodes = _nodes.size();
+	h.slots = _slots.size();
+	h.tables = _tables.size();
+	//FNV-1a of the contents
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	auto add = [&hash](const auto &arena){
+		arena.each_chunk([&hash](const auto* p, uint32_t n){
+			const uint8_t* b = (const uint8_t*)p;
+			for(std::size_t i=0; i<n*sizeof(*p); ++i){
+				hash = (hash ^ b[i])*0x100000001B3ULL;
+			}
+		});
+	};
+	add(_nodes);
+	add(_slots);
+	add(_tables);
+	h.id = (uint32_t)(hash ^ (hash >> 32)) | 1;
+	std::string pad(DICT_ALIGN, '\0');
+	of.write((const char*)&h, sizeof(h));
+	of.write(pad.data(), DICT_ALIGN - sizeof(h));
+	auto put = [&of, &pad](const auto &arena){
+		std::size_t size = 0;
+		arena.each_chunk([&](const auto* p, uint32_t n){
+			of.write((const char*)p, n*sizeof(*p));
+			size += n*sizeof(*p);
+		});
+		of.write(pad.data(), (DICT_ALIGN - size % DICT_ALIGN) % DICT_ALIGN);
+	};
+	put(_nodes);
+	put(_slots);
+	put(_tables);
+}
+
+void SharedContextTree::_select_kernel(){
+	switch(_depth){
+		case 8:
+			_predict_fn = &SharedContextTree::_predict<8>;
+			_commit_fn = &observe_path<8>;
+			break;
+		case 12:
+			_predict_fn = &SharedContextTree::_predict<12>;
+			_commit_fn = &observe_path<12>;
+			break;
+		case 16:
+			_predict_fn = &SharedContextTree::_predict<16>;
+			_commit_fn = &observe_path<16>;
 			break;
+		case 32:
+			_predict_fn = &SharedContextTree::_predict<32>;
+			_commit_fn = &observe_path<32>;
+			break;
+		default:
+			_predict_fn = &SharedContextTree::_predict<0>;
+			_commit_fn = &observe_path<0>;
+	}
+}
+
+void SharedContextTree::walk(const ContextBuffer &ctx){
+	_ctx = &ctx;
+	if(!_table){
+		_walk[0] = &_nodes[0];
+		_walk_len = 1;
+	}
+}
+
+int SharedContextTree::predict(int id,
+		int _probs[], int32_t _betas[], Stats* _path[]){
+	STATS(stats::Timer t(stats::local().predict_ns));
+	return (this->*_predict_fn)(id, _probs, _betas, _path);
+}
+
+void SharedContextTree::commit(bool b, int len, const int32_t _betas[], Stats* _path[]){
+	STATS(stats::Timer t(stats::local().commit_ns); ++stats::local().updates);
+	if(len == _depth){
+		_commit_fn(b, len, _betas, _path);
+	}else{
+		observe_path<0>(b, len, _betas, _path);
+	}
+}
+
+template<int D>
+int SharedContextTree::_predict(int id,
+		int _probs[], int32_t _betas[], Stats* _path[]){
+	const int depth = D ? D : _depth;
+	int len = 0;
+	uint64_t h[MAX_DEPTH];
+	if(_table){
+		prefetch_path(*_table, *_ctx, depth, id, h);
+	}
+	Stats* s;
+	do{
+		if(_table){
+			s = _table->find(h[len]);
+		}else{
+			if(len == _walk_len){
+				//first predictor to go this deep
+				_walk[len] = _get_child(_walk[len-1], (*_ctx)[len-1]);
+				++_walk_len;
+			}
+			Node* n = _walk[len];
+			s = &_slots[find_or_add(_slots, _tables, n->slot, n->slots, &Slot::id, (uint8_t)id)];
 		}
-		++i;
+		_path[len++] = s;
+	}while(len < depth && s->a + s->b >= _grow);
+	if(len == depth){
+		weigh<D>(depth, _probs, _betas, _path);
+	}else{
+		weigh<0>(len, _probs, _betas, _path);
+	}
+	return len;
+}
+
+void SharedContextTree::prefetch(int id, const ContextBuffer &ctx) const{
+	if(_table){
+		uint64_t h[MAX_DEPTH];
+		prefetch_path(*_table, ctx, _depth, id, h);
 	}
 }
 
-bool ContextTree::Node::has_child(char c){ 
-	return children.count(c)>0;
+SharedContextTree::Node* SharedContextTree::_get_child(Node* n, char c){
+	return &_nodes[find_or_add(_nodes, _tables, n->child, n->kids, &Node::sym, c)];
 }
 
-bool ContextTree::Node::is_leaf(){ 
-	return children.empty();
+/* As ContextTree::prune, for each AsciiTree node on its own: a slot 
+ * is kept if its count is at least min_count and the slot of the same
+ * node in the parent context has beta < 1. Contexts left without slots
+ * are dropped. */
+void SharedContextTree::prune(int min_count){
+	if(_table){
+		return;
+	}
+	Arena<Node> nodes;
+	Arena<Slot> slots;
+	Arena<ContextTree::Table,0> tables;
+	slots.alloc();
+	std::array<bool,256> ids;
+	ids.fill(true);
+	_copy(_nodes[0], 0, min_count, ids, nodes, slots, tables);
+	_nodes.swap(nodes);
+	_slots.swap(slots);
+	_tables.swap(tables);
 }
 
-ContextTree::Node* ContextTree::Node::get_child(char c){
-	if(!has_child(c)){
-		children[c] = std::make_unique<Node>();
+/* Copy the context n at `level` with the slots of the nodes in ids, 
+ * returns its new index or 0 if it has nothing to keep */
+uint32_t SharedContextTree::_copy(const Node &n, int level, int min_count, const std::array<bool,256> &ids,
+		Arena<Node> &nodes, Arena<Slot> &slots, Arena<ContextTree::Table,0> &tables) const{
+	std::vector<uint32_t> keep;
+	for(uint32_t i : list_items(_slots, _tables, n.slot, n.slots)){
+		const Slot &s = _slots[i];
+		if(level == 0 || (ids[s.id] && s.a + s.b >= min_count)){
+			keep.push_back(i);
+		}
+	}
+	if(keep.empty() && level > 0){
+		return 0;
+	}
+	uint32_t k = nodes.alloc();
+	Node &m = nodes[k];
+	m.sym = n.sym;
+	std::array<bool,256> kid_ids{};
+	bool any = false;
+	for(uint32_t &i : keep){
+		const Slot &s = _slots[i];
+		kid_ids[s.id] = s.lbeta < 0;
+		any |= s.lbeta < 0;
+		i = slots.alloc();
+		static_cast<Stats&>(slots[i]) = s;
+		slots[i].id = s.id;
+	}
+	link_items(slots, tables, keep, m.slot, m.slots, &Slot::id);
+	if(n.kids == 0 || level == _depth-1 || !any){
+		return k;
+	}
+	std::vector<uint32_t> kids;
+	for(uint32_t i : list_items(_nodes, _tables, n.child, n.kids)){
+		uint32_t j = _copy(_nodes[i], level+1, min_count, kid_ids, nodes, slots, tables);
+		if(j != 0){
+			kids.push_back(j);
+		}
 	}
-	return children[c].get();
+	link_items(nodes, tables, kids, m.child, m.kids, &Node::sym);
+	return k;
 }
 
-bool AsciiTree::Node::is_leaf(){
-	return children.empty();
+void SharedContextTree::clear(){
+	if(_table){
+		return;
+	}
+	_nodes.clear();
+	_slots.clear();
+	_tables.clear();
+	_nodes.alloc();
+	_slots.alloc();
 }
 
-bool AsciiTree::Node::has_child(bool c){
-	return children.count(c)>0;
+void SharedContextTree::meter(std::size_t* grown){
+	_nodes.meter(grown);
+	_slots.meter(grown);
+	_tables.meter(grown);
 }
 
-AsciiTree::Node* AsciiTree::Node::get_child(bool b){
-	if(!has_child(b)){
-		children[b] = std::make_unique<Node>();
+/* Count the slots of each AsciiTree node and at each depth */
+void SharedContextTree::census(stats::Census &c) const{
+	c.bytes += bytes();
+	if(_table){
+		return;
+	}
+	if(c.per_depth.size() < _depth){
+		c.per_depth.resize(_depth);
+	}
+	std::vector<std::pair<uint32_t,int>> todo = {{0, 0}};
+	while(!todo.empty()){
+		auto [k, level] = todo.back();
+		todo.pop_back();
+		const Node &n = _nodes[k];
+		for(uint32_t i : list_items(_slots, _tables, n.slot, n.slots)){
+			uint8_t id = _slots[i].id;
+			if(c.per_tree.size() <= id){
+				c.per_tree.resize(id+1);
+			}
+			++c.per_tree[id];
+			++c.per_depth[level];
+		}
+		for(uint32_t i : list_items(_nodes, _tables, n.child, n.kids)){
+			todo.push_back({i, level+1});
+		}
 	}
-	return children[b].get();
 }
 
-AsciiTree::AsciiTree(std::size_t depth) :
-	_depth(depth), _cached(false){
-	_root = std::make_unique<Node>();
-	_spawn(_root.get(), 0);
-	for(int i=0; i<8; ++i){
-		_probs[i] = new double[2*_depth];
-		_betas[i] = new double[2*_depth];
-		_path[i] = new ContextTree::Node*[_depth];
-		for(int j=0; j<_depth; ++j){
-			_path[i][j] = nullptr;
-			_probs[i][2*j] = 1.0, _probs[i][2*j+1] = 1.0;
-			_betas[i][2*j] = 1.0, _betas[i][2*j+1] = 1.0;
+std::size_t SharedContextTree::bytes() const{
+	if(_table){
+		return 0; // accounted by the table
+	}
+	return _nodes.bytes() + _slots.bytes() + _tables.bytes();
+}
+
+std::string huffman_shape(const uint64_t hist[256]){
+	std::vector<int> syms;
+	std::vector<uint64_t> w;
+	for(int c=0; c<256; ++c){
+		if(hist[c] > 0){
+			syms.push_back(c);
+			w.push_back(hist[c]);
+		}
+	}
+	if(syms.empty()){
+		return "";
+	}
+	if(syms.size() == 1){
+		//a tree needs two leaves
+		syms.push_back(syms[0] ^ 1);
+		w.push_back(1);
+	}
+	std::size_t m = syms.size();
+	std::vector<int> len(m);
+	while(true){
+		//merge the two lightest, leaves are 0..m-1 and merges follow
+		std::vector<int> parent(2*m - 1, -1);
+		typedef std::pair<uint64_t,int> Item;
+		std::priority_queue<Item, std::vector<Item>, std::greater<Item>> q;
+		for(std::size_t i=0; i<m; ++i){
+			q.push({w[i], i});
+		}
+		for(int next = m; q.size() > 1; ++next){
+			Item a = q.top();
+			q.pop();
+			Item b = q.top();
+			q.pop();
+			parent[a.second] = parent[b.second] = next;
+			q.push({a.first + b.first, next});
 		}
+		int longest = 0;
+		for(std::size_t i=0; i<m; ++i){
+			len[i] = 0;
+			for(int k = i; parent[k] >= 0; k = parent[k]){
+				++len[i];
+			}
+			longest = std::max(longest, len[i]);
+		}
+		if(longest <= MAX_CODE){
+			break;
+		}
+		//flatten the counts until the code fits
+		for(uint64_t &x : w){
+			x = (x + 1)/2;
+		}
+	}
+	std::string shape(256, '0');
+	for(std::size_t i=0; i<m; ++i){
+		shape[syms[i]] = "0123456789abcdef"[len[i]];
 	}
+	return shape;
 }
 
-AsciiTree::~AsciiTree(){
-	for(int i=0; i<8; ++i){
-		delete[] _probs[i];
-		delete[] _betas[i];
-		delete[] _path[i]; 
+AsciiTree::AsciiTree(const ModelParams &params) :
+	_depth(params.depth), _grow(params.grow), _walked(false), _limit(params.limit << 20), 
+	_restart(params.restart), _grown(0), _ctx(params.depth), _cached(false){
+	if(params.mem > 0){
+		_table = std::make_unique<HashTable>(params.mem);
 	}
+	if(!params.dict.empty()){
+		_shared = std::make_unique<SharedContextTree>(_depth, _grow, params.dict);
+	}else if(params.shared){
+		_shared = _table ? std::make_unique<SharedContextTree>(_depth, _grow, _table.get())
+			: std::make_unique<SharedContextTree>(_depth, _grow);
+	}
+	if(_shared && _limit > 0){
+		_shared->meter(&_grown);
+	}
+	_build(params.shape);
+	for(int i=0; i<MAX_CODE; ++i){
+		_probs[i].fill(PROB_ONE/2);
+		_betas[i].fill(0);
+		_path[i].fill(nullptr);
+	}
+	_len.fill(0);
 }
 
-void AsciiTree::_spawn(Node* n, int depth){
-	for( int i=0; i<2; ++i){ 
-		n->children[i] = std::make_unique<Node>();
-		n->ctx_tree = std::make_unique<ContextTree>(_depth);
-		if(depth < 8){
-			_spawn(n->get_child(i), depth+1);
+std::array<int, 256> shape_lengths(const std::string &shape){
+	std::array<int, 256> lens;
+	lens.fill(8);
+	if(!shape.empty()){
+		if(shape.size() != 256){
+			throw std::runtime_error("Bad decomposition tree");
+		}
+		for(int c=0; c<256; ++c){
+			char h = shape[c];
+			lens[c] = isdigit(h) ? h - '0' : h >= 'a' && h <= 'f' ? h - 'a' + 10 : -1;
+			if(lens[c] < 0){
+				throw std::runtime_error("Bad decomposition tree");
+			}
 		}
 	}
+	//the code must be complete, so every inner node has two children
+	uint64_t kraft = 0;
+	for(int c=0; c<256; ++c){
+		if(lens[c] > 0){
+			kraft += 1 << (MAX_CODE - lens[c]);
+		}
+	}
+	if(kraft != 1 << MAX_CODE){
+		throw std::runtime_error("Bad decomposition tree");
+	}
+	return lens;
+}
+
+/* Lay out the canonical code of the lengths in shape, see Shape */
+void AsciiTree::_build(const std::string &shape){
+	std::array<int, 256> lens = shape_lengths(shape);
+	std::vector<int> order;
+	for(int c=0; c<256; ++c){
+		if(lens[c] > 0){
+			order.push_back(c);
+		}
+	}
+	//canonical code: consecutive values in order of length, then byte
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b){ return lens[a] < lens[b]; });
+	uint32_t bits = 0;
+	int prev = lens[order[0]];
+	for(std::size_t i=0; i<order.size(); ++i){
+		int c = order[i];
+		bits <<= lens[c] - prev;
+		prev = lens[c];
+		_shape.codes[c].bits = bits++;
+		_shape.codes[c].len = lens[c];
+		_shape.syms[i] = c;
+	}
+	//each level holds the children of the inner nodes above it
+	Shape &sh = _shape;
+	for(int L=0, leaf0=0, id0=1; L<=MAX_CODE; ++L){
+		uint32_t nodes = L == 0 ? 1 : 2*sh.inner[L-1];
+		sh.first[L] = L == 0 ? 0 : 2*(sh.first[L-1] + sh.leaves[L-1]);
+		sh.leaves[L] = std::count(lens.begin(), lens.end(), L == 0 ? -1 : L);
+		sh.inner[L] = nodes - sh.leaves[L];
+		sh.leaf0[L] = leaf0;
+		sh.id0[L] = id0;
+		leaf0 += sh.leaves[L];
+		id0 += sh.inner[L];
+	}
+	_root = std::make_unique<Node>();
+	_root->shape = &_shape;
+	_root->id = 1;
+}
+
+void AsciiTree::Node::_spawn(bool b){
+	uptr kid = std::make_unique<Node>();
+	kid->shape = shape;
+	kid->level = level + 1;
+	kid->path = 2*path + b;
+	int L = kid->level;
+	uint32_t i = kid->path - shape->first[L];
+	if(i < shape->leaves[L]){
+		kid->sym = shape->syms[shape->leaf0[L] + i];
+	}else{
+		kid->id = shape->id0[L] + i - shape->leaves[L];
+	}
+	children[b] = std::move(kid);
+}
+
+/* Heap order index of the inner node id, its path with a leading 1 */
+std::size_t AsciiTree::_heap_index(int id) const{
+	for(int L=0; L<=MAX_CODE; ++L){
+		if(id < _shape.id0[L] + (int)_shape.inner[L]){
+			uint32_t path = _shape.first[L] + _shape.leaves[L] + id - _shape.id0[L];
+			return ((std::size_t)1 << L) + path;
+		}
+	}
+	return 0;
 }
 
 void AsciiTree::update(char c){  
+	//the next context is known now, start loading the path of the 
+	//first bit of the next byte while the commits run
+	_ctx.push(c);
+	if(_shared){
+		_shared->prefetch(_root->id, _ctx);
+	}else if(_root->ctx_tree){
+		_root->ctx_tree->prefetch(_ctx);
+	}
+	const Code &code = _shape.codes[(uint8_t)c];
 	Node* n = _root.get();
-	for(int i = 7; i>=0; --i){
-		//correct dummy update
-		if((c >> i)&1){
-			(n->ctx_tree)->reupdate(1, _probs[i], _betas[i], _path[i]);
-			n = n->get_child(1);
+	for(int k = 0; k < code.len; ++k){
+		bool b = code.bit(k);
+		if(_shared){
+			_shared->commit(b, _len[k], _betas[k].data(), _path[k].data());
 		}else{
-			n = n->get_child(0);
+			(n->ctx_tree)->commit(b, _len[k], _betas[k].data(), _path[k].data());
 		}
+		n = n->get_child(b);
+	}
+	if(_table){
+		_table->tick();
+	}
+	if(_grown > 0){
+		_grown = 0;
+		_fit();
 	}
-	_ctx.push_front(c);
-	_ctx.pop_back();
+	_walked = false;
 	_cached = false;
 }
 
-double AsciiTree::predict_bit(Node* n, int i){
-	(n->ctx_tree)->update(0, _ctx, _probs[i], _betas[i], _path[i]);
-	return _probs[i][0]; //(n->ctx_tree)-> Pr(0)
+/* Keep the trees under the memory limit. Pruning gets more aggressive 
+ * until the trees take at most half the limit, if that fails (or with
+ * restart) the model starts over. */
+void AsciiTree::_fit(){
+	auto bytes = [this](){
+		std::size_t total = _shared ? _shared->bytes() : 0;
+		for(ContextTree* t : _ctx_trees){
+			total += t->bytes();
+		}
+		return total;
+	};
+	if(bytes() <= _limit){
+		return;
+	}
+	if(!_restart){
+		for(int min_count = 2; min_count <= 256; min_count *= 2){
+			if(_shared){
+				_shared->prune(min_count);
+			}
+			for(ContextTree* t : _ctx_trees){
+				t->prune(min_count);
+			}
+			if(bytes() <= _limit/2){
+				return;
+			}
+		}
+	}
+	if(_shared){
+		_shared->clear();
+	}
+	for(ContextTree* t : _ctx_trees){
+		t->clear();
+	}
+}
+
+/* Predict the k-th decision of the byte at node n, keeping the path 
+ * and betas for update */
+void AsciiTree::_predict(Node* n, int k){
+	if(_shared){
+		if(!_walked){
+			_shared->walk(_ctx);
+			_walked = true;
+		}
+		_len[k] = _shared->predict(n->id, _probs[k].data(), _betas[k].data(), _path[k].data());
+	}else{
+		if(!n->ctx_tree){
+			if(_table){
+				n->ctx_tree = std::make_unique<ContextTree>(_depth, _grow, _table.get(), n->id);
+			}else{
+				n->ctx_tree = std::make_unique<ContextTree>(_depth, _grow);
+			}
+			_ctx_trees.push_back(n->ctx_tree.get());
+			if(_limit > 0){
+				n->ctx_tree->meter(&_grown);
+			}
+		}
+		_len[k] = (n->ctx_tree)->predict(_ctx, _probs[k].data(), _betas[k].data(), _path[k].data());
+	}
+}
+
+int AsciiTree::predict_bit(Node* n, int k){
+	_predict(n, k);
+	return _probs[k][0]; //(n->ctx_tree)-> Pr(0)
 }
 
 double AsciiTree::predict(char c){ 
 	if(_cached){
 		return _prob;
 	}
+	const Code &code = _shape.codes[(uint8_t)c];
 	Node* n = _root.get();
 	bool b;
 	double p = 1.0;
 	double cp = 0.0; 
-	for(int i = 7; i >= 0; --i){
-		// dummy update
-		(n->ctx_tree)->update(0, _ctx, _probs[i], _betas[i], _path[i]);
-		b = (c >> i)&1;
+	for(int k = 0; k < code.len; ++k){
+		_predict(n, k);
+		b = code.bit(k);
 		if(b){
-			cp += p*_probs[i][0]; 
-			p *= _probs[i][1];
-			n = n->get_child(1);
+			cp += p*_probs[k][0]/PROB_ONE; 
+			p *= (double)_probs[k][1]/PROB_ONE;
 		}else{
-			p *= _probs[i][0];
-			n = n->get_child(0);
+			p *= (double)_probs[k][0]/PROB_ONE;
 		}
+		n = n->get_child(b);
 	}
 	_cum_prob = cp; 
 	_prob = p;
@@ -194,38 +1065,95 @@ double AsciiTree::cum_prob(char c){
 
 char AsciiTree::decode(double cum_prob){
 	Node* n = _root.get();
-	int out = 0;
 	double d;
 	double p = 1.0;
 	double cp = 0.0; 
-	for(int i =7; i>=0; --i){
-		(n->ctx_tree)->update(0, _ctx, _probs[i], _betas[i], _path[i]);
-		d = p*_probs[i][0]; 
+	for(int k = 0; !n->is_leaf(); ++k){
+		_predict(n, k);
+		d = p*_probs[k][0]/PROB_ONE; 
 		if(cum_prob < cp+d){
-			out = 2*out;
 			p = d; 
 			n = n->get_child(0);
 		}else{
-			out = 2*out +1;
 			cp += d; 
-			p *= _probs[i][1]; 
+			p *= (double)_probs[k][1]/PROB_ONE; 
 			n = n->get_child(1);
 		}
 	}
 	_prob = p;
 	_cum_prob = cp;
 	_cached = true;
-	return (char)out; 
+	return (char)n->sym; 
 }
 
-void AsciiTree::load_context(const std::deque<char> &init_ctx){
-	if(init_ctx.size() != _depth){
-		std::cerr << "Context must be " << _depth << " chars" << std::endl;
+/* Start from the n bytes preceding the input, oldest first,
+ * after zeros if there are fewer than depth */
+void AsciiTree::load_context(const char* init_ctx, std::size_t n){
+	if(n > _depth){
+		std::cerr << "Context must be at most " << _depth << " chars" << std::endl;
 		return;
 	}
-	_ctx = init_ctx; 
+	for(std::size_t i=n; i<_depth; ++i){
+		_ctx.push(0);
+	}
+	for(std::size_t i=0; i<n; ++i){
+		_ctx.push(init_ctx[i]);
+	}
+	_walked = false;
 }
 
 AsciiTree::Node* AsciiTree::get_root(){
 	return _root.get();
 }
+
+/* Write the model as a dictionary, see SharedContextTree::save */
+void AsciiTree::save(std::ostream &of) const{
+	if(!_shared){
+		throw std::runtime_error("Only shared trie models can be saved");
+	}
+	_shared->save(of);
+}
+
+void AsciiTree::census(stats::Census &c) const{
+	++c.models;
+	c.bytes += _table ? _table->bytes() : 0;
+	if(_shared){
+		//the trie counts by node id, report them in heap order
+		stats::Census by_id;
+		_shared->census(by_id);
+		c.bytes += by_id.bytes;
+		c.per_depth = by_id.per_depth;
+		for(std::size_t id=1; id<by_id.per_tree.size(); ++id){
+			std::size_t k = _heap_index(id);
+			if(c.per_tree.size() <= k){
+				c.per_tree.resize(k+1);
+			}
+			c.per_tree[k] += by_id.per_tree[id];
+		}
+		return;
+	}
+	//number the nodes in heap order, as the decisions lead to them
+	std::vector<std::pair<const Node*,std::size_t>> todo = {{_root.get(), 1}};
+	while(!todo.empty()){
+		auto [n, k] = todo.back();
+		todo.pop_back();
+		if(!n->ctx_tree){
+			continue;
+		}
+		c.bytes += n->ctx_tree->bytes();
+		if(n->ctx_tree->size() == 0 || 
+			(n->ctx_tree->size() == 1 && n->ctx_tree->root().a + n->ctx_tree->root().b == 0)){
+			continue; // never used
+		}
+		if(c.per_tree.size() <= k){
+			c.per_tree.resize(k+1);
+		}
+		c.per_tree[k] += n->ctx_tree->size();
+		n->ctx_tree->census(c.per_depth);
+		for(int b=0; b<2; ++b){
+			if(n->children[b]){
+				todo.push_back({n->children[b].get(), 2*k + b});
+			}
+		}
+	}
+}
@@ -29,65 +29,340 @@
 #include <cmath>
 #include <iostream>
 #include <vector>
+#include <array>
+#include <string>
+#include "arena.hpp"
+#include "stats.hpp"
+#include "cow_mapping.hpp"
 
 #pragma once
 
+/* Model settings. They are stored in the .cz header so that the 
+ * decoder builds exactly the same model. */
+struct ModelParams{
+	std::size_t depth = 8;
+	std::size_t mem = 0; // hashed model budget in MiB, 0 for unbounded trees
+	std::size_t limit = 0; // tree model budget in MiB, 0 for no limit
+	bool restart = false; // restart the model at the limit instead of pruning
+	bool shared = false; // one context trie for all nodes of the AsciiTree
+	int grow = 0; // visits of a context before its path goes deeper, 0 for full paths
+	std::string shape; // of the decomposition tree, see AsciiTree; empty for ASCII
+	uint32_t dict_id = 0; // of the dictionary the model starts from, 0 for none
+	std::string dict; // path of that dictionary
+};
+
+class HashTable;
+
+const int MAX_DEPTH = 64;
+
+/* Longest path of a byte through the decomposition tree */
+const int MAX_CODE = 15;
+
+/* Probabilities are fixed point with PROB_BITS fraction bits, 
+ * in [1, PROB_ONE-1] so both outcomes stay codable */
+const int PROB_BITS = 16;
+const int PROB_ONE = 1 << PROB_BITS;
+
+
+/* The last MAX_DEPTH bytes, most recent first, in a ring buffer.
+ * It also keeps a hash of the context of every length, rolled forward 
+ * with each byte, so a hashed model finds any context in O(1). */
+class ContextBuffer{
+	public:
+		ContextBuffer(std::size_t depth) : _depth(depth), _pos(0){
+			_buf.fill(0);
+			_hashes.fill(0);
+		}
+		void push(char c){
+			_pos = (_pos - 1) & (SIZE - 1);
+			_buf[_pos] = c;
+			//polynomial in the bytes, most recent first
+			for(int i = _depth-1; i > 0; --i){
+				_hashes[i] = (uint8_t)c + 1 + _hashes[i-1]*0x100000001B3ULL;
+			}
+		}
+		/* The i-th most recent byte */
+		char operator[](int i) const{ return _buf[(_pos + i) & (SIZE - 1)]; }
+		/* Hash of the i most recent bytes */
+		uint64_t hash(int i) const{ return _hashes[i]; }
+	private:
+		static const int SIZE = MAX_DEPTH; // a power of two
+		int _depth;
+		int _pos;
+		std::array<char, SIZE> _buf;
+		std::array<uint64_t, MAX_DEPTH> _hashes;
+};
+
 /* ContextTree takes character contexts and does binary predictions
  * using the Context Tree Weighting algorithm (rf. Willems, Shtarkov, Tjalkens)*/
 class ContextTree{
 	public:
+		/* Statistics of one context */
+		struct Stats{
+			int32_t lbeta = 0; // log2 beta in Q16
+			uint8_t a = 0, b = 0; // 0-1 counters
+		};
+		/* Nodes live in a per-tree arena and refer to each other by index. 
+		 * Children are a sibling list until a node has more than 
+		 * DENSE_KIDS of them, then a direct 256-way table. 
+		 * Index 0 is the root, so 0 also means "none". */
+		struct Node : Stats{
+			char sym = 0; // context symbol leading to this node
+			uint8_t kids = 0; // number of children, DENSE if tabled
+			uint32_t child = 0; // first child, or table index if dense
+			uint32_t next = 0; // next sibling
+		};
+		struct Table{
+			uint32_t child[256];
+		};
+		static const uint8_t DENSE = 0xff;
+		static const uint8_t DENSE_KIDS = 16;
+
+		uint8_t _depth;
+		ContextTree(std::size_t depth, int grow);
+		/* Context tree whose nodes live in a shared hash table, 
+		 * seed tells the trees sharing it apart */
+		ContextTree(std::size_t depth, int grow, HashTable* table, uint64_t seed);
+		/* Find the context path of ctx and weigh it, without 
+		 * changing the statistics. The path goes below a node only
+		 * once the node has been seen `grow` times, so contexts seen 
+		 * once cost a single node; the last node is weighed as a 
+		 * leaf. Returns the length of the path. */
+		int predict(const ContextBuffer &ctx,
+				int _probs[], int32_t _betas[], Stats* _path[]);
+		/* Update the predicted path of length len with outcome b */
+		void commit(bool b, int len, const int32_t _betas[], Stats* _path[]);
+		/* Start loading the path that predict(ctx) will take. Only a 
+		 * hashed tree does anything: in the arena each node is found 
+		 * from its parent, so the path can't be loaded ahead. */
+		void prefetch(const ContextBuffer &ctx) const;
+		Node* get_child(Node* n, char c);
+		void prune(int min_count);
+		void clear();
+		/* Count the bytes of arena chunks allocated from now on in *grown */
+		void meter(std::size_t* grown);
+		void census(std::vector<uint64_t> &per_depth) const;
+		std::size_t size() const;
+		std::size_t bytes() const;
+		const Node& root() const{ return _nodes[0]; }
+	private:
+		/* The kernels are instantiated for common depths so their loops
+		 * unroll, D = 0 is the generic one looping over _depth */
+		template<int D>
+		int _predict(const ContextBuffer &ctx,
+				int _probs[], int32_t _betas[], Stats* _path[]);
+		decltype(&ContextTree::_predict<0>) _predict_fn;
+		void (*_commit_fn)(bool, int, const int32_t[], Stats*[]);
+		void _select_kernel();
+		int _grow;
+		Arena<Node> _nodes;
+		Arena<Table,0> _tables;
+		void _census(const Node &n, int level, std::vector<uint64_t> &per_depth) const;
+		uint32_t _copy(const Node &n, int level, int min_count,
+				Arena<Node> &nodes, Arena<Table,0> &tables) const;
+		HashTable* _table;
+		uint64_t _seed;
+};
+
+/* One trie of byte contexts shared by all the binary predictors of an 
+ * AsciiTree. A trie node holds the statistics of the AsciiTree nodes 
+ * (by heap index) that were visited in its context, so the context path 
+ * of a byte is walked once instead of once per bit. Slots are listed 
+ * like children, and tabled when there are more than DENSE_KIDS. */
+class SharedContextTree{
+	public:
+		typedef ContextTree::Stats Stats;
+		struct Slot : Stats{
+			uint8_t id = 0; // AsciiTree node
+			uint32_t next = 0; // next slot of the same context
+		};
 		struct Node{
-			typedef std::unique_ptr<Node> uptr;
-			double beta;
-			uint8_t a,b; // 0-1 counters
-			std::unordered_map<char, uptr> children;
-			Node() : a(0), b(0), beta(1.0){}
-			bool has_child(char c);
-			bool is_leaf();
-			Node* get_child(char c);
+			char sym = 0;
+			uint8_t kids = 0; // number of children, DENSE if tabled
+			uint8_t slots = 0; // number of slots, DENSE if tabled
+			uint32_t child = 0; // first child, or table index if dense
+			uint32_t next = 0; // next sibling
+			uint32_t slot = 0; // first slot, or table index if dense
 		};
+
+		/* A dictionary file starts with this, followed by the node, slot
+		 * and table arenas, each at a multiple of DICT_ALIGN bytes */
+		struct DictHeader{
+			char magic[8];
+			uint32_t id; // hash of the contents
+			uint32_t depth;
+			uint32_t nodes, slots, tables;
+		};
+		static const std::size_t DICT_ALIGN = 4096;
+
 		uint8_t _depth;
-		ContextTree(std::size_t depth);
-		void update(bool b, const std::deque<char> &ctx,
-				double _probs[], double _betas[], Node* _path[]);
-		void reupdate(bool b, 
-				double _probs[], double _betas[], Node* _path[]);
+		SharedContextTree(std::size_t depth, int grow);
+		SharedContextTree(std::size_t depth, int grow, HashTable* table);
+		/* Start from the dictionary at path, mapped copy-on-write */
+		SharedContextTree(std::size_t depth, int grow, const std::string &path);
+		static DictHeader read_dict(const std::string &path);
+		void save(std::ostream &of) const;
+		/* Start on the context path of the next byte, it is extended 
+		 * as far as the predictors need */
+		void walk(const ContextBuffer &ctx);
+		/* As ContextTree, for AsciiTree node id on the walked path */
+		int predict(int id,
+				int _probs[], int32_t _betas[], Stats* _path[]);
+		void commit(bool b, int len, const int32_t _betas[], Stats* _path[]);
+		/* Start loading the path of node id in the context ctx, if hashed */
+		void prefetch(int id, const ContextBuffer &ctx) const;
+		void prune(int min_count);
+		void clear();
+		void meter(std::size_t* grown);
+		void census(stats::Census &c) const;
+		std::size_t bytes() const;
 	private:
-		Node::uptr _root;
+		template<int D>
+		int _predict(int id,
+				int _probs[], int32_t _betas[], Stats* _path[]);
+		decltype(&SharedContextTree::_predict<0>) _predict_fn;
+		void (*_commit_fn)(bool, int, const int32_t[], Stats*[]);
+		void _select_kernel();
+		Node* _get_child(Node* n, char c);
+		uint32_t _copy(const Node &n, int level, int min_count, const std::array<bool,256> &ids,
+				Arena<Node> &nodes, Arena<Slot> &slots, Arena<ContextTree::Table,0> &tables) const;
+		int _grow;
+		Arena<Node> _nodes;
+		Arena<Slot> _slots; // index 0 is unused, as "none"
+		Arena<ContextTree::Table,0> _tables;
+		std::array<Node*, MAX_DEPTH> _walk;
+		int _walk_len; // nodes of the walk found so far
+		const ContextBuffer* _ctx; // of the walk
+		HashTable* _table;
+		std::vector<std::unique_ptr<CowMapping>> _maps; // of the dictionary
+		template<typename T, int BASE>
+		void _map(int fd, off_t &offset, off_t file_size, uint32_t n, Arena<T,BASE> &arena);
 };
 
-/* Simple ASCII decomposition tree has context trees in internal nodes and characters in the leaves. */
+/* Fixed size store for context statistics of all the trees of a model.
+ * Buckets of 4 slots fill a cache line. A slot is tagged with a check
+ * value of its context hash; on a miss the slot with the lowest counts 
+ * is replaced, the least recently used among equals. Slots used while 
+ * coding the current byte are never replaced so the paths stay valid 
+ * until they are committed. */
+class HashTable{
+	public:
+		struct Slot : ContextTree::Stats{
+			uint16_t check = 0; // 0 for empty
+			uint32_t stamp = 0; // byte of last use
+		};
+		static const int WAYS = 4;
+		/* A bucket is one cache line */
+		struct alignas(64) Bucket{
+			Slot slots[WAYS];
+		};
+		HashTable(std::size_t mib);
+		ContextTree::Stats* find(uint64_t h);
+		/* Start loading the bucket of h, to be found soon */
+		void prefetch(uint64_t h) const{
+			__builtin_prefetch(&_buckets[_bucket(h)], 1);
+		}
+		void tick(){ ++_now; }
+		std::size_t bytes() const{ return _buckets.size()*sizeof(Bucket); }
+	private:
+		std::vector<Bucket> _buckets;
+		std::size_t _bucket(uint64_t h) const{ return _shift < 64 ? h >> _shift : 0; }
+		int _shift;
+		uint32_t _now;
+		Slot _spill;
+};
+
+/* Code lengths, limited to MAX_CODE, of a Huffman code for the byte 
+ * counts `hist`, as a shape for ModelParams */
+std::string huffman_shape(const uint64_t hist[256]);
+/* Code lengths of the bytes in a shape, 0 for bytes it can't code. 
+ * Throws unless the shape is a complete code. */
+std::array<int, 256> shape_lengths(const std::string &shape);
+
+/* The decomposition tree has context trees in its inner nodes and the 
+ * bytes in its leaves: each byte is coded as the binary decisions on the
+ * path from the root to its leaf, every inner node predicting its 
+ * decision with its context tree. The shape is the canonical prefix code 
+ * of the code lengths given as 256 hex digits, one per byte value and 0
+ * for bytes that do not occur. The default shape, every byte at length 
+ * 8, is the ASCII tree: the bits of the byte, most significant first. 
+ * Shaped by byte frequencies, frequent bytes take fewer decisions. */
 class AsciiTree {
 	public:
+		struct Code{
+			uint16_t bits = 0; // the path from the root, first step highest
+			uint8_t len = 0; // 0 for bytes outside the shape
+			bool bit(int k) const{ return (bits >> (len - 1 - k)) & 1; }
+		};
+		/* The canonical code of a shape by level: the nodes at level L 
+		 * are the paths first[L] ... first[L] + leaves[L] + inner[L] - 1, 
+		 * leaves first, so a node knows what it is from its path alone */
+		struct Shape{
+			std::array<Code, 256> codes;
+			std::array<uint8_t, 256> syms; // of the leaves, by level and path
+			uint32_t first[MAX_CODE+1], leaves[MAX_CODE+1], inner[MAX_CODE+1];
+			uint16_t leaf0[MAX_CODE+1]; // syms index of the first leaf of a level
+			uint16_t id0[MAX_CODE+1]; // id of the first inner node of a level
+		};
+		/* Nodes are made when a path first reaches them, and their 
+		 * context trees on their first prediction */
 		struct Node{
 			typedef std::unique_ptr<Node> uptr;
-			std::unordered_map<bool,uptr> children;
+			uptr children[2];
 			std::unique_ptr<ContextTree> ctx_tree;
-			Node(){}
-			bool is_leaf();
-			bool has_child(bool c);
-			Node* get_child(bool c);
+			const Shape* shape = nullptr;
+			uint16_t id = 0; // of an inner node, breadth first from the root at 1
+			int16_t sym = -1; // byte of a leaf
+			uint8_t level = 0; // the path from the root, as in Code
+			uint16_t path = 0;
+			bool is_leaf() const{ return sym >= 0; }
+			Node* get_child(bool b){
+				if(!children[b]){
+					_spawn(b);
+				}
+				return children[b].get();
+			}
+			void _spawn(bool b);
 		};
 
-		AsciiTree(std::size_t depth);
-		~AsciiTree();
-		void load_context(const std::deque<char> &init_ctx);
+		AsciiTree(const ModelParams &params);
+		AsciiTree(const AsciiTree&) = delete; // nodes point into it
+		AsciiTree& operator=(const AsciiTree&) = delete;
+		void load_context(const char* init_ctx, std::size_t n);
+		/* Commit byte c, after the prediction of each of its decisions */
 		void update(char c);
 		double predict(char c);
 		double cum_prob(char c);
 		char decode(double cum_prob);
-		double predict_bit(Node* n, int i);
+		/* Pr(0) of the decision at node n, the k-th on the path of the byte */
+		int predict_bit(Node* n, int k);
 		Node* get_root();
+		const Code& code(char c) const{ return _shape.codes[(uint8_t)c]; }
+		void census(stats::Census &c) const;
+		void save(std::ostream &of) const;
 	private: 
 		std::size_t _depth;
+		int _grow;
 		Node::uptr _root;	
-		std::deque<char> _ctx;
+		Shape _shape;
+		std::unique_ptr<HashTable> _table;
+		std::vector<ContextTree*> _ctx_trees;
+		std::unique_ptr<SharedContextTree> _shared;
+		bool _walked; // the shared tree has the path of the current byte
+		std::size_t _limit; // bytes
+		bool _restart;
+		std::size_t _grown; // bytes allocated since the last _fit
+		ContextBuffer _ctx;
 		double _cum_prob;
 		double _prob;
 		bool _cached;
-		void _spawn(Node* n, int depth);
-		double* _probs[8];
-		double* _betas[8];
-		ContextTree::Node** _path[8];
+		void _build(const std::string &shape);
+		std::size_t _heap_index(int id) const;
+		void _fit();
+		void _predict(Node* n, int k);
+		std::array<int, 2*MAX_DEPTH> _probs[MAX_CODE];
+		std::array<int32_t, 2*MAX_DEPTH> _betas[MAX_CODE]; // log betas after either outcome
+		std::array<ContextTree::Stats*, MAX_DEPTH> _path[MAX_CODE];
+		std::array<int, MAX_CODE> _len; // of the paths
 };
 
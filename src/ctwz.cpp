@@ -0,0 +1,645 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "ctwz.hpp"
+#include "work_stealing.hpp"
+#include "range_coder.hpp"
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <deque>
+#include <future>
+#include <cstring>
+#include <climits>
+
+void encode_char(AsciiTree &T, char c, RangeEncoder &enc){ 
+	AsciiTree::Node* n = T.get_root();
+	const AsciiTree::Code &code = T.code(c);
+	bool b;
+	int p0;
+	for(int k=0; k<code.len; ++k){ 
+		b = code.bit(k);
+		p0 = T.predict_bit(n,k);
+		n = n->get_child(b);
+		enc.encode(b,p0,PROB_BITS);
+	}
+	T.update(c);
+}
+
+char decode_char(AsciiTree &T, RangeDecoder &dec){ 
+	AsciiTree::Node* n = T.get_root();
+	bool b;
+	int p0;
+	for(int k=0; !n->is_leaf(); ++k){
+		p0 = T.predict_bit(n,k);
+		b = dec.decode(p0,PROB_BITS);
+		n = n->get_child(b);
+	}
+	T.update((char)n->sym);
+	return (char)n->sym;
+}
+
+/* Learn c as if it was coded */
+void learn_char(AsciiTree &T, char c){
+	AsciiTree::Node* n = T.get_root();
+	const AsciiTree::Code &code = T.code(c);
+	for(int k=0; k<code.len; ++k){
+		T.predict_bit(n,k);
+		n = n->get_child(code.bit(k));
+	}
+	T.update(c);
+}
+
+/* Add the model to the census of --stats */
+void take_census(const AsciiTree &T){
+	if(stats::enabled){
+		stats::Census c;
+		T.census(c);
+		stats::add_census(c);
+	}
+}
+
+/* Bytes stored raw as the initial context of a stream. A model from a 
+ * dictionary starts from a zero context and codes every byte. */
+std::size_t raw_context(const ModelParams &params){
+	return params.dict.empty() ? params.depth : 0;
+}
+
+/* Compress the `n` bytes at `in` with a fresh model and coder.
+ * The first raw_context bytes are stored raw as the initial context.
+ * Returns the number of bytes written. */
+long long encode_stream(const char* in, std::size_t n, std::ostream &of, 
+		const ModelParams &params, const Progress &progress){
+	std::size_t depth = raw_context(params);
+	if(n <= depth){
+		of.write(in, n);
+		return n;
+	}
+	//load context
+	of.write(in, depth);
+	AsciiTree T(params);
+	T.load_context(in, depth);
+
+	RangeEncoder enc(of);
+	for(std::size_t rb = depth; rb < n; ++rb){
+		encode_char(T,in[rb],enc);
+		if(progress && rb% 0x4000 == 0){
+			progress(depth + enc.bytes(), rb);
+		}
+	}
+	//end transmission
+	enc.flush();
+	take_census(T);
+	return depth + enc.bytes();
+}
+
+/* Inverse of encode_stream, decodes the `n` bytes at `in` and 
+ * writes `bytes` decoded bytes to `of` */
+void decode_stream(const char* in, std::size_t n, std::ostream &of, long long bytes, 
+		const ModelParams &params, const Progress &progress){
+	std::size_t depth = std::min<long long>(raw_context(params), bytes);
+	depth = std::min(depth, n);
+	//load context
+	of.write(in, depth);
+	bytes -= depth;
+	if(bytes <= 0){
+		return;
+	}
+	AsciiTree T(params);
+	T.load_context(in, depth);
+
+	RangeDecoder dec(in + depth, n - depth);
+	char d;
+	for(long long db = 0; db < bytes; ++db){
+		d = decode_char(T,dec);
+		of.put(d);
+		if(progress && db % 0x4000 == 0){
+			progress(depth + db, dec.pos() - in);
+		}
+	}
+	take_census(T);
+}
+
+/* Run func on the pool and return a future for its result */
+template<typename F>
+auto submit_task(WorkStealingExecutor &pool, F func){
+	typedef decltype(func()) R;
+	auto task = std::make_shared<std::packaged_task<R()>>(func);
+	pool.submit([task]{ (*task)(); });
+	return task->get_future();
+}
+
+void put_u32(std::ostream &of, uint32_t x){
+	for(int i=0; i<4; ++i){
+		of.put((char)(x >> 8*i));
+	}
+}
+
+void put_u64(std::ostream &of, uint64_t x){
+	put_u32(of, x);
+	put_u32(of, x >> 32);
+}
+
+/* Read a u32 at `pos` of the `n` bytes at `in` and advance `pos` */
+bool get_u32(const char* in, std::size_t n, std::size_t &pos, uint32_t &x){
+	if(n - pos < 4){
+		return false;
+	}
+	x = 0;
+	for(int i=0; i<4; ++i){
+		x |= (uint32_t)(uint8_t)in[pos++] << 8*i;
+	}
+	return true;
+}
+
+bool get_u64(const char* in, std::size_t n, std::size_t &pos, uint64_t &x){
+	uint32_t lo, hi;
+	if(!get_u32(in, n, pos, lo) || !get_u32(in, n, pos, hi)){
+		return false;
+	}
+	x = (uint64_t)hi << 32 | lo;
+	return true;
+}
+
+/* Block container: the input is cut into blocks of `block_size` bytes 
+ * which are modeled and coded independently. Each block is stored as 
+ * a 4 byte little endian length and its payload. They are followed by
+ * an index, so any block can be decoded on its own: for each block its
+ * uncompressed offset, the offset of its length field from the end of 
+ * the header (8 bytes each) and its payload length (4 bytes), then the 
+ * number of blocks (8 bytes) and INDEX_MAGIC. */
+const char INDEX_MAGIC[] = "CZIX";
+const std::size_t INDEX_ENTRY = 20;
+
+struct IndexEntry{
+	uint64_t raw_offset, offset;
+	uint32_t len;
+};
+
+long long encode_blocks(const char* in, std::size_t n, std::ostream &of, 
+		const ModelParams &params, std::size_t block_size, int jobs, 
+		const Progress &progress){
+	WorkStealingExecutor pool(jobs);
+	std::deque<std::future<std::string>> pending;
+	std::vector<IndexEntry> index;
+	long long eb = 0, rb = 0;
+	auto flush_one = [&](){
+		std::string out = pending.front().get();
+		pending.pop_front();
+		index.push_back({index.size()*block_size, (uint64_t)eb, (uint32_t)out.size()});
+		put_u32(of, out.size());
+		of.write(out.data(), out.size());
+		eb += 4 + out.size();
+		if(progress){
+			progress(eb, rb);
+		}
+	};
+	for(std::size_t pos = 0; pos < n; pos += block_size){
+		const char* block = in + pos;
+		std::size_t len = std::min(block_size, n - pos);
+		rb += len;
+		pending.push_back(submit_task(pool, [block,len,&params]{
+			std::ostringstream out;
+			encode_stream(block, len, out, params);
+			return out.str();
+		}));
+		//bound the number of blocks in memory
+		if(pending.size() >= 2*(std::size_t)jobs){
+			flush_one();
+		}
+	}
+	while(!pending.empty()){
+		flush_one();
+	}
+	for(const IndexEntry &e : index){
+		put_u64(of, e.raw_offset);
+		put_u64(of, e.offset);
+		put_u32(of, e.len);
+	}
+	put_u64(of, index.size());
+	of.write(INDEX_MAGIC, 4);
+	return eb + index.size()*INDEX_ENTRY + 12;
+}
+
+void decode_blocks(const char* in, std::size_t n, std::ostream &of, long long bytes, 
+		const ModelParams &params, std::size_t block_size, int jobs,
+		const Progress &progress){
+	WorkStealingExecutor pool(jobs);
+	std::deque<std::future<std::string>> pending;
+	long long db = 0;
+	std::size_t pos = 0;
+	auto flush_one = [&](){
+		std::string out = pending.front().get();
+		of.write(out.data(), out.size());
+		db += out.size();
+		pending.pop_front();
+		if(progress){
+			progress(db, pos);
+		}
+	};
+	while(bytes > 0){
+		uint32_t len;
+		if(!get_u32(in, n, pos, len) || len > n - pos){
+			throw std::runtime_error("Truncated block");
+		}
+		const char* block = in + pos;
+		pos += len;
+		long long m = std::min<long long>(bytes, block_size);
+		bytes -= m;
+		pending.push_back(submit_task(pool, [block,len,m,&params]{
+			std::ostringstream out;
+			decode_stream(block, len, out, m, params);
+			return out.str();
+		}));
+		if(pending.size() >= 2*(std::size_t)jobs){
+			flush_one();
+		}
+	}
+	while(!pending.empty()){
+		flush_one();
+	}
+}
+
+/* Read the block index at the end of the `n` bytes at `in`, which 
+ * hold `bytes` bytes in blocks of `block_size` */
+std::vector<IndexEntry> read_index(const char* in, std::size_t n, uint64_t bytes, 
+		std::size_t block_size){
+	if(n < 12 || memcmp(in + n - 4, INDEX_MAGIC, 4) != 0){
+		throw std::runtime_error("No block index, encode with -B or -j to seek");
+	}
+	std::size_t pos = n - 12;
+	uint64_t count;
+	get_u64(in, n, pos, count);
+	if(count > (n - 12)/INDEX_ENTRY || count != (bytes + block_size - 1)/block_size){
+		throw std::runtime_error("Bad block index");
+	}
+	pos = n - 12 - count*INDEX_ENTRY;
+	std::size_t blocks_end = pos;
+	std::vector<IndexEntry> index(count);
+	uint64_t next = 0; // the blocks follow each other up to the index
+	for(std::size_t i=0; i<count; ++i){
+		IndexEntry &e = index[i];
+		get_u64(in, n, pos, e.raw_offset);
+		get_u64(in, n, pos, e.offset);
+		get_u32(in, n, pos, e.len);
+		if(e.raw_offset != i*block_size || e.offset != next || blocks_end - next < 4 
+			|| e.len > blocks_end - next - 4){
+			throw std::runtime_error("Bad block index");
+		}
+		next += 4 + e.len;
+	}
+	if(next != blocks_end){
+		throw std::runtime_error("Bad block index");
+	}
+	return index;
+}
+
+/* Decode only the blocks covering [off, off+len) of the output 
+ * and write that slice */
+void decode_range(const char* in, std::size_t n, std::ostream &of, long long bytes,
+		const ModelParams &params, std::size_t block_size, uint64_t off, uint64_t len, int jobs){
+	if(off >= (uint64_t)bytes){
+		return;
+	}
+	std::vector<IndexEntry> index = read_index(in, n, bytes, block_size);
+	uint64_t end = len < bytes - off ? off + len : bytes;
+	WorkStealingExecutor pool(jobs);
+	std::deque<std::future<std::string>> pending;
+	std::deque<std::pair<uint64_t,uint64_t>> slices; // of each pending block
+	auto flush_one = [&](){
+		std::string out = pending.front().get();
+		auto [from, to] = slices.front();
+		pending.pop_front();
+		slices.pop_front();
+		of.write(out.data() + from, to - from);
+	};
+	for(std::size_t i=0; i<index.size(); ++i){
+		uint64_t start = index[i].raw_offset;
+		uint64_t stop = i+1 < index.size() ? index[i+1].raw_offset : bytes;
+		if(stop <= off || start >= end){
+			continue;
+		}
+		const char* block = in + index[i].offset + 4;
+		uint32_t blen = index[i].len;
+		long long m = stop - start;
+		slices.push_back({std::max(off, start) - start, std::min(end, stop) - start});
+		pending.push_back(submit_task(pool, [block,blen,m,&params]{
+			std::ostringstream out;
+			decode_stream(block, blen, out, m, params);
+			return out.str();
+		}));
+		if(pending.size() >= 2*(std::size_t)jobs){
+			flush_one();
+		}
+	}
+	while(!pending.empty()){
+		flush_one();
+	}
+}
+void write_header(std::ostream &of, const Header &h){
+	of << VERSION << std::endl << std::quoted(h.name) << " " << h.params.depth 
+		<< " " << h.bytes << " " << h.block_size << " " << h.params.mem 
+		<< " " << h.params.limit << " " << h.params.restart << " " << h.params.shared 
+		<< " " << h.params.dict_id << " " << h.params.grow 
+		<< " " << (h.params.shape.empty() ? "-" : h.params.shape) << std::endl;
+}
+
+Header read_header(std::istream &file){
+	Header h;
+	std::string ver;
+	file >> ver;
+	if(ver != VERSION){
+		throw std::runtime_error("Unsupported format " + ver);
+	}
+	char c = 0;
+	file >> std::quoted(h.name) >> h.params.depth >> h.bytes >> h.block_size >> h.params.mem
+		>> h.params.limit >> h.params.restart >> h.params.shared >> h.params.dict_id
+		>> h.params.grow >> h.params.shape;
+	file.get(c);
+	if(!file || c != '\n'){
+		throw std::runtime_error("Bad header");
+	}
+	if(h.params.shape == "-"){
+		h.params.shape.clear();
+	}
+	//the model is sized from these, so they must be ones ctwz writes
+	if(h.params.depth < 1 || h.params.depth > MAX_DEPTH || h.params.grow < 0 
+		|| h.params.grow > 255 || h.params.mem > INT_MAX || h.params.limit > INT_MAX 
+		|| h.bytes < -1 || h.block_size > UINT32_MAX/2){
+		throw std::runtime_error("Bad header");
+	}
+	shape_lengths(h.params.shape);
+	//the decoder creates a file of this name in the working directory
+	if(h.name.empty() || h.name.find('/') != std::string::npos || h.name == "." || h.name == ".."){
+		throw std::runtime_error("Bad file name in header");
+	}
+	return h;
+}
+void use_dict(Header &h, const char* dict){
+	if(h.params.dict_id == 0){
+		return;
+	}
+	if(dict == nullptr){
+		throw std::runtime_error("Coded with a dictionary, decode it with -D");
+	}
+	if(SharedContextTree::read_dict(dict).id != h.params.dict_id){
+		throw std::runtime_error(std::string() + "Coded with another dictionary than " + dict);
+	}
+	h.params.dict = dict;
+}
+
+std::size_t header_size(const char* in, std::size_t n){
+	const char* end = (const char*)memchr(in, '\n', n);
+	if(end){
+		end = (const char*)memchr(end + 1, '\n', in + n - end - 1);
+	}
+	return end ? end + 1 - in : 0;
+}
+
+/* Decode the `n` bytes at `in` that follow the header, 
+ * returns the number of bytes decoded */
+long long decode_body(const char* in, std::size_t n, std::ostream &of, const Header &h, 
+		int jobs, const Progress &progress){
+	if(h.bytes < 0){
+		//a piece at a time, so the output need not fit in memory
+		StreamDecoder dec(h);
+		std::string out;
+		long long db = 0;
+		for(std::size_t pos = 0; pos < n && !dec.done(); pos += DEFAULT_CHUNK_SIZE){
+			dec.decode(in + pos, std::min<std::size_t>(DEFAULT_CHUNK_SIZE, n - pos), out);
+			of.write(out.data(), out.size());
+			db += out.size();
+			out.clear();
+			if(progress){
+				progress(db, pos);
+			}
+		}
+		if(!dec.done()){
+			throw std::runtime_error("Truncated stream");
+		}
+		return db;
+	}else if(h.block_size == 0){
+		decode_stream(in, n, of, h.bytes, h.params, progress);
+	}else{
+		decode_blocks(in, n, of, h.bytes, h.params, h.block_size, jobs, progress);
+	}
+	return h.bytes;
+}
+
+/* Output stream appending to a string */
+struct StringBuf : std::streambuf{
+	std::string &s;
+	StringBuf(std::string &s) : s(s){}
+	int_type overflow(int_type c) override{
+		if(!traits_type::eq_int_type(c, traits_type::eof())){
+			s.push_back(traits_type::to_char_type(c));
+		}
+		return traits_type::not_eof(c);
+	}
+	std::streamsize xsputn(const char* p, std::streamsize n) override{
+		s.append(p, n);
+		return n;
+	}
+};
+
+/* Chunked stream (-c): chunks of a 4 byte raw length, a 4 byte payload 
+ * length and the payload, ended by a zero raw length. A chunk is what one
+ * read returned, at most `chunk_size` bytes, so data from a slow producer
+ * goes out as soon as it arrives. The model carries over between chunks;
+ * a payload is the raw bytes of the initial context, if any are still 
+ * missing, followed by a complete range coder stream for the rest. */
+StreamEncoder::StreamEncoder(const ModelParams &params, const std::string &name,
+		std::size_t chunk_size){
+	_h.name = name;
+	_h.bytes = -1;
+	_h.block_size = chunk_size;
+	_h.params = params;
+	reset();
+}
+
+void StreamEncoder::reset(){
+	_started = false;
+	_ended = false;
+	_ctx.clear();
+	_T.reset();
+	if(raw_context(_h.params) == 0){
+		_T = std::make_unique<AsciiTree>(_h.params);
+		_T->load_context(nullptr, 0);
+	}
+}
+
+void StreamEncoder::code(const char* in, std::size_t n, std::string &out){
+	if(_ended){
+		throw std::runtime_error("The stream has ended");
+	}
+	if(!_started){
+		StringBuf buf(out);
+		std::ostream of(&buf);
+		write_header(of, _h);
+		_started = true;
+	}
+	for(std::size_t pos = 0; pos < n; pos += _h.block_size){
+		_chunk(in + pos, std::min(_h.block_size, n - pos), out);
+	}
+}
+
+void StreamEncoder::_chunk(const char* in, uint32_t n, std::string &out){
+	StringBuf buf(out);
+	std::ostream of(&buf);
+	put_u32(of, n);
+	put_u32(of, 0); // payload length, once known
+	std::size_t start = out.size();
+	uint32_t i = 0;
+	for(; i<n && !_T; ++i){
+		out.push_back(in[i]);
+		_ctx.push_back(in[i]);
+		if(_ctx.size() == _h.params.depth){
+			_T = std::make_unique<AsciiTree>(_h.params);
+			_T->load_context(_ctx.data(), _ctx.size());
+		}
+	}
+	if(i < n){
+		RangeEncoder enc(of);
+		for(; i<n; ++i){
+			encode_char(*_T, in[i], enc);
+		}
+		enc.flush();
+	}
+	of.flush();
+	uint32_t len = out.size() - start;
+	for(int k=0; k<4; ++k){
+		out[start - 4 + k] = (char)(len >> 8*k);
+	}
+}
+
+void StreamEncoder::end(std::string &out){
+	if(_ended){
+		return;
+	}
+	code(nullptr, 0, out);
+	_ended = true;
+	StringBuf buf(out);
+	std::ostream of(&buf);
+	put_u32(of, 0);
+	if(_T){
+		take_census(*_T);
+	}
+}
+
+StreamDecoder::StreamDecoder(const char* dict) : _dict(dict ? dict : ""){
+	reset();
+}
+
+StreamDecoder::StreamDecoder(const Header &h) : _h(h){
+	reset();
+	_header = true;
+	if(raw_context(_h.params) == 0){
+		_T = std::make_unique<AsciiTree>(_h.params);
+		_T->load_context(nullptr, 0);
+	}
+}
+
+void StreamDecoder::reset(){
+	_header = false;
+	_done = false;
+	_in.clear();
+	_ctx.clear();
+	_T.reset();
+}
+
+void StreamDecoder::decode(const char* in, std::size_t n, std::string &out){
+	if(_done){
+		return;
+	}
+	if(_in.empty()){
+		//decode in place, keep what is left
+		std::size_t pos = _parse(in, n, out);
+		_in.assign(in + pos, n - pos);
+	}else{
+		_in.append(in, n);
+		std::size_t pos = _parse(_in.data(), _in.size(), out);
+		_in.erase(0, pos);
+	}
+}
+
+/* Decode the complete chunks at the start of in, returns their size */
+std::size_t StreamDecoder::_parse(const char* in, std::size_t n, std::string &out){
+	std::size_t pos = 0;
+	if(!_header){
+		pos = header_size(in, n);
+		if(pos == 0){
+			return 0;
+		}
+		std::istringstream header(std::string(in, pos));
+		_h = read_header(header);
+		if(_h.bytes >= 0){
+			throw std::runtime_error("Not a chunked stream");
+		}
+		use_dict(_h, _dict.empty() ? nullptr : _dict.c_str());
+		_header = true;
+		if(raw_context(_h.params) == 0){
+			_T = std::make_unique<AsciiTree>(_h.params);
+			_T->load_context(nullptr, 0);
+		}
+	}
+	while(true){
+		std::size_t p = pos;
+		uint32_t m, len;
+		if(!get_u32(in, n, p, m)){
+			return pos;
+		}
+		if(m == 0){
+			_done = true;
+			if(_T){
+				take_census(*_T);
+			}
+			return p;
+		}
+		if(!get_u32(in, n, p, len) || len > n - p){
+			return pos;
+		}
+		_chunk(in + p, len, m, out);
+		pos = p + len;
+	}
+}
+
+/* Decode the chunk of n bytes from the `len` bytes of its payload */
+void StreamDecoder::_chunk(const char* payload, uint32_t len, uint32_t n, std::string &out){
+	out.reserve(out.size() + n);
+	uint32_t i = 0;
+	char c;
+	for(; i<n && !_T; ++i){
+		c = i < len ? payload[i] : 0;
+		out.push_back(c);
+		_ctx.push_back(c);
+		if(_ctx.size() == _h.params.depth){
+			_T = std::make_unique<AsciiTree>(_h.params);
+			_T->load_context(_ctx.data(), _ctx.size());
+		}
+	}
+	if(i < n){
+		RangeDecoder dec(payload + i, len - std::min(i, len));
+		for(; i<n; ++i){
+			out.push_back(decode_char(*_T, dec));
+		}
+	}
+}
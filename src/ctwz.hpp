@@ -0,0 +1,137 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include <string>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include "ctw.hpp"
+
+#pragma once
+
+/* The ctwz formats on memory and streams, without files or a console.
+ * The command line tool (encoding.cpp) and the C API (libctwz.h) are
+ * built on this. */
+
+#define VERSION "CTWZ-0.13"
+
+#define DEFAULT_BLOCK_SIZE (4<<20)
+#define DEFAULT_CHUNK_SIZE (1<<20)
+
+/* The header is a version line and a line of 
+ * "filename" depth bytes block_size mem limit restart shared dict_id grow shape
+ * The file name is quoted as by std::quoted. shape is "-" for the ASCII tree. block_size is 0 for a single stream. A chunked stream has bytes -1, 
+ * and filename "-" if it came from stdin. */
+struct Header{
+	std::string name;
+	long long bytes = 0;
+	std::size_t block_size = 0;
+	ModelParams params;
+};
+
+void write_header(std::ostream &of, const Header &h);
+Header read_header(std::istream &file);
+/* Size of the header at the start of the `n` bytes at `in`, 0 if it 
+ * is not complete */
+std::size_t header_size(const char* in, std::size_t n);
+/* Start the model of the header from dict, if it was coded with one */
+void use_dict(Header &h, const char* dict);
+
+/* Called with the number of bytes coded and read so far */
+typedef std::function<void(long long, long long)> Progress;
+
+/* Learn c as if it was coded */
+void learn_char(AsciiTree &T, char c);
+/* Add the model to the census of --stats */
+void take_census(const AsciiTree &T);
+
+/* Compress the `n` bytes at `in` with a fresh model and coder.
+ * Returns the number of bytes written. */
+long long encode_stream(const char* in, std::size_t n, std::ostream &of, 
+		const ModelParams &params, const Progress &progress = nullptr);
+/* Inverse of encode_stream, decodes the `n` bytes at `in` and 
+ * writes `bytes` decoded bytes to `of`. Progress gets the bytes 
+ * decoded and the bytes of `in` read. */
+void decode_stream(const char* in, std::size_t n, std::ostream &of, long long bytes, 
+		const ModelParams &params, const Progress &progress = nullptr);
+/* Block container of independently coded blocks on `jobs` threads */
+long long encode_blocks(const char* in, std::size_t n, std::ostream &of, 
+		const ModelParams &params, std::size_t block_size, int jobs,
+		const Progress &progress = nullptr);
+void decode_blocks(const char* in, std::size_t n, std::ostream &of, long long bytes, 
+		const ModelParams &params, std::size_t block_size, int jobs,
+		const Progress &progress = nullptr);
+/* Decode only the blocks covering [off, off+len) of the output 
+ * and write that slice */
+void decode_range(const char* in, std::size_t n, std::ostream &of, long long bytes,
+		const ModelParams &params, std::size_t block_size, uint64_t off, uint64_t len, int jobs);
+/* Decode the `n` bytes at `in` that follow the header, 
+ * returns the number of bytes decoded */
+long long decode_body(const char* in, std::size_t n, std::ostream &of, const Header &h, 
+		int jobs, const Progress &progress = nullptr);
+
+/* Encoder of the chunked stream format (-c) for data that arrives in 
+ * pieces. Every call to code() adds chunks of at most chunk_size bytes 
+ * and the model carries over. Output is appended to a string, so the 
+ * caller can reuse its buffer. */
+class StreamEncoder{
+	public:
+		StreamEncoder(const ModelParams &params, const std::string &name = "-",
+				std::size_t chunk_size = DEFAULT_CHUNK_SIZE);
+		void code(const char* in, std::size_t n, std::string &out);
+		/* Write the end of the stream */
+		void end(std::string &out);
+		/* Start a new stream with the same settings */
+		void reset();
+	private:
+		Header _h;
+		bool _started, _ended;
+		std::unique_ptr<AsciiTree> _T;
+		std::string _ctx; // initial context so far
+		void _chunk(const char* in, uint32_t n, std::string &out);
+};
+
+/* Decoder of the chunked stream format. It takes input in pieces of any 
+ * size and decodes every chunk as soon as it is complete. */
+class StreamDecoder{
+	public:
+		/* For a stream that starts with its header, coded with dict if any */
+		StreamDecoder(const char* dict = nullptr);
+		/* For the chunks that follow a header that was read already */
+		StreamDecoder(const Header &h);
+		/* Decode what the input completes, appending to out */
+		void decode(const char* in, std::size_t n, std::string &out);
+		/* The end of the stream was decoded */
+		bool done() const{ return _done; }
+		/* Start on a new stream */
+		void reset();
+	private:
+		std::string _dict;
+		bool _header; // has been read
+		bool _done;
+		Header _h;
+		std::string _in; // incomplete input
+		std::unique_ptr<AsciiTree> _T;
+		std::string _ctx;
+		std::size_t _parse(const char* in, std::size_t n, std::string &out);
+		void _chunk(const char* payload, uint32_t len, uint32_t n, std::string &out);
+};
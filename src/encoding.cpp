@@ -19,185 +19,124 @@
 * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 */
 
-#include "ctw.hpp"
-#include <fstream>
+
+#include "ctwz.hpp"
+#include "file_io.hpp"
+#include <sstream>
 #include <filesystem>
-#include <cassert>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <thread>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-#define VERSION "CTWZ-0.1"
-#define HIGH 0xffffff
-#define HALF 0x800000
-#define QTR 0x400000
-#define THREE_QTR 0xc00000
+/* The ctwz command line tool, on top of the formats of ctwz.hpp */
 
-void write(bool b, int n, std::queue<bool> &buf){
-	buf.push(b); 
-	for(int i = 0; i<n; ++i){
-		buf.push(!b);
-	}
-}
+#define DIRECT_IO_MIN (1ll<<30) // outputs this big bypass the page cache
 
-void encode_bit(bool b, double p0, std::queue<bool> &out, bool eot=false){
-	static int low=0, high = HIGH;
-	static int count=0;
-	int range = high-low+1;
-	if(eot){
-		++count;
-		if(low<QTR){
-			write(0,count,out);
-		}else{
-			write(1,count,out);
-		}
-		return;
-	}
-	if(b){
-		low += p0*range;
-	}else{
-		high = low + range*p0;
-	}
+/* Read what the input has ready, at most n bytes. Returns 0 at the end. */
+std::size_t read_some(int fd, char* buf, std::size_t n){
+	STATS(stats::Timer t(stats::local().io_ns));
 	while(true){
-		if( high < HALF){
-			write(0,count,out);
-			count = 0;
-		}else if( low >= HALF){
-			low -= HALF;
-			high -= HALF;
-			write(1,count,out);
-			count = 0;
-		}else if ( QTR <= low && high < THREE_QTR){
-			++count;
-			low -= QTR;
-			high -= QTR;
-		}else{ break; }
-		low *= 2;
-		high = 2*high +1;
+		ssize_t r = ::read(fd, buf, n);
+		if(r >= 0){
+			return r;
+		}
+		if(errno != EINTR){
+			throw std::runtime_error(std::string() + "Read error: " + strerror(errno));
+		}
 	}
 }
 
-bool decode_bit(double p0, int &code, std::queue<bool> &bits){
-	static int low=0, high=HIGH;
-	int range = high-low+1;
-	double d = (code-low+1)/((double)range);
-	bool b = (d<p0)?0:1;  
-	if(b){
-		low += p0*range;
-	}else{
-		high = low+range*p0;
-	}
-	while(true){ 
-		if( high< HALF){
-		}else if( low >= HALF){
-			low -= HALF;
-			high -= HALF;
-			code -= HALF;
-		}else if( QTR <= low && high < THREE_QTR){ 
-			code -= QTR;
-			low -= QTR;
-			high -= QTR;
-		}else{ break;}
-		low *= 2;
-		high = 2*high+1;
-		code = 2*code + bits.front();
-		bits.pop();
-	}
-	return b;
+/* Seconds since `start` */
+double since(std::chrono::steady_clock::time_point start){
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 
-void encode_char(AsciiTree &T, char c, std::queue<bool> &obuf){ 
-	AsciiTree::Node* n = T.get_root();
-	bool b;
-	double p0;
-	for(int i=7; i>=0; --i){ 
-		b = (c>>i)&1;
-		p0 = T.predict_bit(n,i);
-		n = n->get_child(b);
-		encode_bit(b,p0,obuf);
-		//std::cout << " " << p0 << std::endl;
+/* Compress fname into fname.cz. With huffman the decomposition tree is 
+ * shaped by the byte counts of a first pass over the file. */
+void encode_file(char* fname, ModelParams params, std::size_t block_size, int jobs,
+		bool huffman){
+	auto start = std::chrono::steady_clock::now();
+	MappedFile file(fname);
+	if(huffman){
+		uint64_t hist[256] = {};
+		for(std::size_t i=0; i<file.size(); ++i){
+			++hist[(uint8_t)file.data()[i]];
+		}
+		params.shape = huffman_shape(hist);
 	}
-	T.update(c);
-}
-
-char decode_char(AsciiTree &T, int &code, std::queue<bool> &bits){ 
-	AsciiTree::Node* n = T.get_root();
-	bool b;
-	double p0;
-	int c = 0;
-	for(int i=7; i>=0; --i){
-		p0 = T.predict_bit(n,i);
-		b = decode_bit(p0,code,bits);
-		n = n->get_child(b);
-		c = 2*c+b; 
+	FileBuf buf(std::string() + fname + ".cz", file.size() >= DIRECT_IO_MIN);
+	std::ostream of(&buf);
+	std::filesystem::path path{fname};
+	Header h;
+	h.name = path.filename().string();
+	h.bytes = file.size(); 
+	h.block_size = block_size;
+	h.params = params;
+	write_header(of, h);
+	//pipeline: a reader thread loads the input ahead of the coder and 
+	//FileBuf writes the output behind it
+	ReadAhead ahead(file.data(), file.size());
+	auto progress = [&ahead](long long eb, long long rb){
+		ahead.consumed(rb);
+		std::cout << "\r\e[K (encoded) " << (eb >> 10) << " KiB"
+		<< " | " << (rb >> 10) << " KiB (read)" <<  std::flush;
+	};
+	long long eb;
+	if(block_size == 0){
+		eb = encode_stream(file.data(), file.size(), of, params, progress);
+	}else{
+		eb = encode_blocks(file.data(), file.size(), of, params, block_size, jobs, progress);
+	}
+	of.flush();
+	buf.close();
+	std::cout << std::endl << eb << " bytes" << std::endl;
+	if(stats::enabled){
+		stats::report(std::cerr, h.bytes, eb, since(start));
 	}
-	T.update((char)c);
-	return (char)c;
 }
 
-char output_byte(std::queue<bool> &buf){
-	int c = 0; 
-	for( int i =0; i<8; ++i){
-		if(buf.empty()){
-			c *= 2;
-		}else{
-			c = 2*c + buf.front();
-			buf.pop();
+/* Compress fname, or stdin if null, to stdout as a chunked stream */
+void encode_pipe(char* fname, const ModelParams &params, std::size_t chunk_size){
+	auto start = std::chrono::steady_clock::now();
+	int fd = 0;
+	std::string name = "-";
+	if(fname){
+		fd = ::open(fname, O_RDONLY);
+		if(fd < 0){
+			throw std::runtime_error(std::string() + "Can't open file " + fname); 
 		}
+		name = std::filesystem::path(fname).filename().string();
 	}
-	return (char)c;
-}
-
-void input_byte(char c, std::queue<bool> &buf){
-	for(int i=7; i>=0 ; --i){
-		bool b = (c >> i)&1;
-		buf.push(b);
+	StreamEncoder enc(params, name, chunk_size);
+	std::vector<char> chunk(chunk_size);
+	std::string out;
+	long long rb = 0, eb = 0;
+	std::size_t n;
+	//every read goes out as a chunk
+	while((n = read_some(fd, chunk.data(), chunk_size)) > 0){
+		rb += n;
+		enc.code(chunk.data(), n, out);
+		std::cout.write(out.data(), out.size());
+		std::cout.flush();
+		eb += out.size();
+		out.clear();
 	}
-}
-
-void encode_file(char* fname, int depth){
-	std::ifstream file(fname, std::ios::in | std::ios::binary);
-	if(!file.is_open()){
-		throw std::runtime_error(std::string() + "Can't open file " + fname); 
+	enc.end(out);
+	std::cout.write(out.data(), out.size());
+	std::cout.flush();
+	eb += out.size();
+	if(fname){
+		::close(fd);
 	}
-	std::ofstream of(std::string() + fname + ".cz", std::ios::out | std::ios::binary);
-	std::filesystem::path path{fname};
-	int bytes = std::filesystem::file_size(path); 
-	of << VERSION << std::endl << path.filename() 
-		<< " " << depth << " "<< bytes << std::endl; 
-
-	//load context
-	char c;
-	std::queue<bool> obuf;
-	std::deque<char> ctx;
-	for(int i=0; i<depth; ++i){
-		file.get(c);
-		of.put(c);
-		ctx.push_front(c);
+	if(stats::enabled){
+		stats::report(std::cerr, rb, eb, since(start));
 	}
-	AsciiTree T(depth);
-	T.load_context(ctx);
-
-	long long eb = 0, rb =0;
-	while(file.get(c)){
-		++rb;
-		encode_char(T,c,obuf);
-		if(obuf.size() >= 8){
-			++eb;
-			of.put(output_byte(obuf));
-		}
-		if(rb% 0x4000 == 0){
-			std::cout << "\r\e[K (encoded) " << (eb >> 10) << " KiB"
-			<< " | " << (rb >> 10) << " KiB (read)" <<  std::flush;
-		}
-	}
-	//end transmission
-	encode_bit(0,0,obuf,true); 
-	while(!obuf.empty()){
-		of.put(output_byte(obuf));
-	}
-	file.close();
-	std::cout << std::endl << eb << " bytes" << std::endl;
 }
-
 bool ask_replace(const std::string &file){
 	std::cout << file << " already exists. Replace it? (y/n)\t"; 
 	char rep;
@@ -214,108 +153,331 @@ bool ask_replace(const std::string &file){
 	}
 }
 
-void decode_file(char* fname){
-	std::ifstream file(fname, std::ios::in | std::ios::binary);
-	if(!file.is_open()){
-		throw std::runtime_error(std::string() + "Can't open file " + fname);
-		return;
+/* Parse the header at the start of the mapped file, returns its size */
+std::size_t map_header(const MappedFile &file, const char* fname, Header &h){
+	std::size_t n = header_size(file.data(), file.size());
+	if(n == 0){
+		throw std::runtime_error(std::string() + "Not a ctwz file " + fname);
 	}
-	//read header
-	std::string of_name, ver;
-	file >> ver, assert(ver == VERSION);
-	char c;
-	int bytes, depth;
-	file >> of_name >> depth >> bytes;
-	file.get(c);
-	assert(c == '\n');
-	of_name.erase(
-		remove( of_name.begin(), of_name.end(), '\"' ),
-		of_name.end()
-	);
-	std::cout << of_name << " " << depth << " "<< bytes << std::endl;
-	if(std::filesystem::exists(of_name)){
-		if(!ask_replace(of_name)){
-			return;
+	std::istringstream header(std::string(file.data(), n));
+	h = read_header(header);
+	return n;
+}
+/* Decompress fname, or stdin if null, into the file named in the header 
+ * or to stdout */
+void decode_file(char* fname, const char* dict, int jobs, bool to_stdout){
+	auto start = std::chrono::steady_clock::now();
+	long long db, cb;
+	if(fname == nullptr){
+		std::vector<char> buf(DEFAULT_CHUNK_SIZE);
+		std::string data, out;
+		std::size_t n, hs;
+		while((hs = header_size(data.data(), data.size())) == 0){
+			if((n = read_some(0, buf.data(), buf.size())) == 0){
+				throw std::runtime_error("Not a ctwz file");
+			}
+			data.append(buf.data(), n);
+		}
+		std::istringstream header(data.substr(0, hs));
+		Header h = read_header(header);
+		use_dict(h, dict);
+		data.erase(0, hs);
+		cb = data.size();
+		if(h.bytes < 0){
+			//decode each piece as it arrives
+			StreamDecoder dec(h);
+			db = 0;
+			dec.decode(data.data(), data.size(), out);
+			while(true){
+				std::cout.write(out.data(), out.size());
+				std::cout.flush();
+				db += out.size();
+				out.clear();
+				if(dec.done() || (n = read_some(0, buf.data(), buf.size())) == 0){
+					break;
+				}
+				cb += n;
+				dec.decode(buf.data(), n, out);
+			}
+			if(!dec.done()){
+				throw std::runtime_error("Truncated stream");
+			}
+		}else{
+			//not a stream, needs all of its input
+			while((n = read_some(0, buf.data(), buf.size())) > 0){
+				data.append(buf.data(), n);
+			}
+			cb = data.size();
+			db = decode_body(data.data(), data.size(), std::cout, h, jobs);
+		}
+		std::cout.flush();
+	}else{
+		MappedFile file(fname);
+		Header h;
+		std::size_t hs = map_header(file, fname, h);
+		use_dict(h, dict);
+		const char* in = file.data() + hs;
+		cb = file.size() - hs;
+		ReadAhead ahead(file.data(), file.size());
+		auto progress = [&ahead,hs](long long, long long rb){
+			ahead.consumed(hs + rb);
+		};
+		if(to_stdout){
+			db = decode_body(in, cb, std::cout, h, jobs, progress);
+			std::cout.flush();
+		}else{
+			if(h.name == "-"){
+				throw std::runtime_error("Stream from stdin has no file name, decode it with -c");
+			}
+			std::cout << h.name << " " << h.params.depth << " "<< h.bytes << std::endl;
+			if(std::filesystem::exists(h.name)){
+				if(!ask_replace(h.name)){
+					return;
+				}
+			}
+			FileBuf buf(h.name, h.bytes >= DIRECT_IO_MIN);
+			std::ostream of(&buf);
+			db = decode_body(in, cb, of, h, jobs, progress);
+			of.flush();
+			buf.close();
 		}
 	}
-	std::ofstream of(of_name, std::ios::out | std::ios::binary);
-
-	//load context
-	std::deque<char> ctx;
-	std::queue<bool> ibuf;
-	for(int i=0; i<depth; ++i){
-		file.get(c);
-		ctx.push_front(c);
-		of.put(c);
-		--bytes;
+	if(stats::enabled){
+		stats::report(std::cerr, db, cb, since(start));
 	}
-	AsciiTree T(depth);
-	T.load_context(ctx);
+}
 
-	//initialize 3 bytes of encoded data
-	for(int i=0; i<3; ++i){
-		file.get(c);
-		input_byte(c,ibuf);
+/* Decompress `len` bytes at offset `off` of fname to stdout */
+void decode_file_range(char* fname, const char* dict, uint64_t off, uint64_t len, int jobs){
+	auto start = std::chrono::steady_clock::now();
+	MappedFile file(fname);
+	Header h;
+	std::size_t hs = map_header(file, fname, h);
+	use_dict(h, dict);
+	if(h.bytes < 0 || h.block_size == 0){
+		throw std::runtime_error("No block index, encode with -B or -j to seek");
 	}
-	int code = 0;
-	for(int i=0; i<24; ++i){
-		code = 2*code + ibuf.front();
-		ibuf.pop();
+	decode_range(file.data() + hs, file.size() - hs, 
+			std::cout, h.bytes, h.params, h.block_size, off, len, jobs);
+	std::cout.flush();
+	if(stats::enabled){
+		uint64_t db = off < (uint64_t)h.bytes ? std::min<uint64_t>(len, h.bytes - off) : 0;
+		stats::report(std::cerr, db, file.size(), since(start));
 	}
-	char d;
-	while(bytes--){
-		if(ibuf.size() < 64){  
-			for(int i=0; i<8; ++i){
-				if(file.get(c)){
-					input_byte(c, ibuf);
-				}else{
-					input_byte(0, ibuf);
-				}
-			}
+}
+
+/* Build the dictionary dict from the samples. Each sample is learned 
+ * from a zero context, as inputs coded with the dictionary start. */
+void train(const char* dict, const std::vector<char*> &samples, const ModelParams &params){
+	auto start = std::chrono::steady_clock::now();
+	AsciiTree T(params);
+	long long rb = 0;
+	for(char* fname : samples){
+		MappedFile file(fname);
+		T.load_context(nullptr, 0);
+		for(std::size_t i=0; i<file.size(); ++i){
+			learn_char(T, file.data()[i]);
 		}
-		d = decode_char(T,code,ibuf);
-		of.put(d);
+		rb += file.size();
+	}
+	FileBuf buf(dict);
+	std::ostream of(&buf);
+	T.save(of);
+	of.flush();
+	buf.close();
+	std::cout << rb << " bytes of samples, " << std::filesystem::file_size(dict) 
+		<< " byte dictionary" << std::endl;
+	take_census(T);
+	if(stats::enabled){
+		stats::report(std::cerr, rb, std::filesystem::file_size(dict), since(start));
 	}
-	file.close();
-	of.close();
 }
 
-void usage(){
+/* Parse a size with an optional K/M/G suffix that ends at `stop`, 
+ * false if s is not one */
+bool parse_size(const char* s, uint64_t &n, char stop = '\0'){
+	if(!isdigit(s[0])){
+		return false;
+	}
+	char* end;
+	errno = 0;
+	n = strtoull(s, &end, 10);
+	int shift = 0;
+	switch(*end){
+		case 'k': case 'K': shift = 10; ++end; break;
+		case 'm': case 'M': shift = 20; ++end; break;
+		case 'g': case 'G': shift = 30; ++end; break;
+	}
+	if(errno == ERANGE || *end != stop || n > UINT64_MAX >> shift){
+		return false;
+	}
+	n <<= shift;
+	return true;
+}
+
+/* Print the usage and exit with status, 0 for -h */
+void usage(int status = 2){
 	std::cout << "ctwz:\n"
 		<< "\tContext tree weighting compressor\n"
 		<< "\tauthor: Meijke Balay <mysatellite99@gmail.com>\n"
 		<< "usage:\n" 
-		<< "\tencode: ctwz [-d depth] file\n" 
-		<< "\tdecode: ctwz -x file" << std::endl;
-	exit(0);
+		<< "\tencode: ctwz [--stats] [-d depth] [-g grow] [-s] [-H | -D dict] [-m MiB | -p MiB [-r]] [-j threads] [-B blocksize] file\n" 
+		<< "\t        ctwz -c [-d depth] [-g grow] [-s] [-D dict] [-m MiB | -p MiB [-r]] [-B chunksize] [file] > out.cz\n" 
+		<< "\ttrain:  ctwz --train dict [-d depth] [-g grow] [-p MiB [-r]] samples...\n" 
+		<< "\tdecode: ctwz -x [--stats] [-D dict] [-j threads] file\n"
+		<< "\t        ctwz -x -c [-D dict] [-j threads] [file.cz] > out\n"
+		<< "\t        ctwz -x --range offset:length [-D dict] [-j threads] file.cz > out" << std::endl;
+	exit(status);
 }
-
 int main(int argc, char* argv[]){
-	int depth = 8;
+	ModelParams params;
+	int jobs = 0;
+	std::size_t block_size = 0;
 	bool decode = false;
+	bool to_stdout = false;
+	bool range = false;
+	bool huffman = false;
+	uint64_t range_off = 0, range_len = 0;
+	char* dict = nullptr;
+	char* train_dict = nullptr;
+	std::vector<char*> files;
 	if(argc < 2){
 		usage();
 	}
-	for(int i=1; i<argc-1; ++i){
+	for(int i=1; i<argc; ++i){
 		if(strcmp(argv[i],"-d")==0){
-			if(i+2<argc && atoi(argv[i+1])>0 && atoi(argv[i+1])<16){
-				depth = atoi(argv[i+1]); 
+			if(i+1<argc && atoi(argv[i+1])>0 && atoi(argv[i+1])<=MAX_DEPTH){
+				params.depth = atoi(argv[i+1]); 
+				++i;
+			}else{
+				usage();
+			}
+		}else if(strcmp(argv[i],"-g")==0){
+			if(i+1<argc && isdigit(argv[i+1][0]) && atoi(argv[i+1])<=255){
+				params.grow = atoi(argv[i+1]); 
+				++i;
+			}else{
+				usage();
+			}
+		}else if(strcmp(argv[i],"-m")==0){
+			if(i+1<argc && atoi(argv[i+1])>0){
+				params.mem = atoi(argv[i+1]); 
+				++i;
+			}else{
+				usage();
+			}
+		}else if(strcmp(argv[i],"-p")==0){
+			if(i+1<argc && atoi(argv[i+1])>0){
+				params.limit = atoi(argv[i+1]); 
+				++i;
+			}else{
+				usage();
+			}
+		}else if(strcmp(argv[i],"-r")==0){
+			params.restart = true;
+		}else if(strcmp(argv[i],"-s")==0){
+			params.shared = true;
+		}else if(strcmp(argv[i],"-H")==0){
+			huffman = true;
+		}else if(strcmp(argv[i],"-j")==0){
+			if(i+1<argc && atoi(argv[i+1])>0){
+				jobs = atoi(argv[i+1]); 
+				++i;
+			}else{
+				usage();
+			}
+		}else if(strcmp(argv[i],"-B")==0){
+			uint64_t b;
+			if(i+1<argc && parse_size(argv[i+1], b) && b > 0 && b <= UINT32_MAX/2){
+				block_size = b; 
 				++i;
 			}else{
 				usage();
 			}
 		}else if(strcmp(argv[i],"-x")==0){
 			decode=true;
+		}else if(strcmp(argv[i],"-c")==0){
+			to_stdout=true;
+		}else if(strcmp(argv[i],"--range")==0){
+			const char* colon = i+1<argc ? strchr(argv[i+1], ':') : nullptr;
+			if(colon && parse_size(argv[i+1], range_off, ':') && parse_size(colon + 1, range_len)){
+				range = true;
+				++i;
+			}else{
+				usage();
+			}
+		}else if(strcmp(argv[i],"-D")==0){
+			if(i+1<argc){
+				dict = argv[i+1]; 
+				++i;
+			}else{
+				usage();
+			}
+		}else if(strcmp(argv[i],"--train")==0){
+			if(i+1<argc){
+				train_dict = argv[i+1]; 
+				++i;
+			}else{
+				usage();
+			}
 		}else if(strcmp(argv[i],"-h")==0){
-			usage();
+			usage(0);
+		}else if(strcmp(argv[i],"--stats")==0){
+			stats::enabled=true;
+		}else if(argv[i][0] != '-'){
+			files.push_back(argv[i]);
 		}else{
 			usage();
 		}
 	}
-	if(decode){
-		decode_file(argv[argc-1]);
+	char* fname = files.empty() ? nullptr : files[0];
+	if(train_dict){
+		if(files.empty() || decode || to_stdout || params.mem > 0){
+			usage();
+		}
+	}else if((fname == nullptr && !to_stdout) || files.size() > 1 
+			|| (range && (!decode || fname == nullptr))){
+		usage();
+	}
+	if(huffman && (train_dict || decode || to_stdout || dict)){
+		//needs a first pass, and dictionaries are ASCII trees
+		usage();
+	}
+	if(dict && !decode){
+		//the dictionary sets the model
+		if(params.mem > 0){
+			usage();
+		}
+		SharedContextTree::DictHeader h = SharedContextTree::read_dict(dict);
+		params.depth = h.depth;
+		params.dict_id = h.id;
+		params.dict = dict;
+	}
+	if(dict || train_dict){
+		params.shared = true;
+	}
+	std::ios::sync_with_stdio(false);
+	if(train_dict){
+		train(train_dict, files, params);
+	}else if(decode){
+		if(jobs == 0){
+			jobs = std::max(1u, std::thread::hardware_concurrency());
+		}
+		if(range){
+			decode_file_range(fname, dict, range_off, range_len, jobs);
+		}else{
+			decode_file(fname, dict, jobs, to_stdout);
+		}
+	}else if(to_stdout){
+		encode_pipe(fname, params, block_size ? block_size : DEFAULT_CHUNK_SIZE);
 	}else{
-		encode_file(argv[argc-1], depth);
+		if(jobs > 0 && block_size == 0){
+			block_size = DEFAULT_BLOCK_SIZE;
+		}
+		if(jobs == 0){
+			jobs = std::max(1u, std::thread::hardware_concurrency());
+		}
+		encode_file(fname, params, block_size, jobs, huffman);
 	}
 	return 0;
 }
@@ -0,0 +1,321 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include <streambuf>
+#include <stdexcept>
+#include <new>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include "spsc_ring.hpp"
+#include "stats.hpp"
+
+#pragma once
+
+/* Read-only memory map of a whole file, advised for sequential reading */
+class MappedFile{
+	public:
+		MappedFile(const char* path) : _data(nullptr), _size(0){
+			int fd = ::open(path, O_RDONLY);
+			if(fd < 0){
+				throw std::runtime_error(std::string() + "Can't open file " + path);
+			}
+			struct stat st;
+			if(fstat(fd, &st) < 0){
+				::close(fd);
+				throw std::runtime_error(std::string() + "Can't stat file " + path);
+			}
+			_size = st.st_size;
+			if(_size > 0){
+				void* p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if(p == MAP_FAILED){
+					::close(fd);
+					throw std::runtime_error(std::string() + "Can't map file " + path);
+				}
+				_data = (const char*)p;
+				madvise(p, _size, MADV_SEQUENTIAL);
+			}
+			::close(fd);
+		}
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		~MappedFile(){
+			if(_data){
+				munmap((void*)_data, _size);
+			}
+		}
+
+		const char* data() const{ return _data; }
+		std::size_t size() const{ return _size; }
+
+	private:
+		const char* _data;
+		std::size_t _size;
+};
+
+/* Reader stage for a mapped input: a thread faults in the pages of 
+ * [data, data+size) a CHUNK at a time, at most AHEAD chunks in front of
+ * the consumer, so the coder finds its input in memory instead of 
+ * waiting on the disk. The reader hands each loaded chunk over on a 
+ * ring that the consumer drains as it reports its position, which 
+ * bounds how far ahead the reader gets. */
+class ReadAhead{
+	public:
+		static const std::size_t CHUNK = 1 << 20;
+		static const int AHEAD = 16;
+
+		ReadAhead(const char* data, std::size_t size) : 
+			_data(data), _size(size), _passed(0), _loaded(AHEAD){
+			if(size > CHUNK){
+				_reader = std::thread(&ReadAhead::_read, this);
+			}
+		}
+		ReadAhead(const ReadAhead&) = delete;
+		ReadAhead& operator=(const ReadAhead&) = delete;
+		~ReadAhead(){
+			_loaded.close();
+			if(_reader.joinable()){
+				_reader.join();
+			}
+		}
+
+		/* The consumer has read everything before pos */
+		void consumed(std::size_t pos){
+			std::size_t chunk;
+			while(_passed < pos/CHUNK && _loaded.try_pop(chunk)){
+				++_passed;
+			}
+		}
+
+	private:
+		const char* _data;
+		std::size_t _size;
+		std::size_t _passed; // chunks popped by the consumer
+		SpscRing<std::size_t> _loaded; // offsets of chunks in memory
+		std::thread _reader;
+
+		void _read(){
+			std::size_t page = sysconf(_SC_PAGESIZE);
+			uint8_t sum = 0;
+			for(std::size_t off = 0; off < _size; off += CHUNK){
+				{
+					STATS(stats::Timer t(stats::local().io_ns));
+					std::size_t end = std::min(off + CHUNK, _size);
+					for(std::size_t i = off; i < end; i += page){
+						sum += ((volatile const char*)_data)[i];
+					}
+				}
+				if(!_loaded.push(off)){
+					break;
+				}
+			}
+			(void)sum;
+		}
+};
+
+/* Output file buffer handing BUFFERS aligned buffers of BUF_SIZE bytes
+ * to a writer thread, so the coder does not wait on the disk unless all
+ * of them are queued. Full buffers go to the writer on one ring and 
+ * come back empty on another. With `direct` the file is opened with 
+ * O_DIRECT so huge outputs bypass the page cache; where that is not 
+ * supported the pages are dropped with posix_fadvise after each write 
+ * instead. A write error is thrown by the next write or by close(). */
+class FileBuf : public std::streambuf{
+	public:
+		static const std::size_t BUF_SIZE = 1 << 20;
+		static const std::size_t ALIGN = 4096;
+		static const int BUFFERS = 4;
+
+		FileBuf(const std::string &path, bool direct = false) : 
+			_direct(direct), _drop(false), _offset(0), 
+			_full(BUFFERS), _empty(BUFFERS), _failed(false){
+			int flags = O_WRONLY | O_CREAT | O_TRUNC;
+			_fd = -1;
+			if(direct){
+				_fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+				if(_fd < 0){
+					_direct = false;
+					_drop = true;
+				}
+			}
+			if(_fd < 0){
+				_fd = ::open(path.c_str(), flags, 0644);
+			}
+			if(_fd < 0){
+				throw std::runtime_error("Can't open file " + path);
+			}
+			std::fill(_bufs, _bufs + BUFFERS, nullptr);
+			for(char* &b : _bufs){
+				b = (char*)aligned_alloc(ALIGN, BUF_SIZE);
+				if(b == nullptr){
+					for(char* a : _bufs){
+						free(a);
+					}
+					::close(_fd);
+					throw std::bad_alloc();
+				}
+				if(b != _bufs[0]){
+					_empty.push(b);
+				}
+			}
+			setp(_bufs[0], _bufs[0] + BUF_SIZE);
+			_writer = std::thread(&FileBuf::_write_all, this);
+		}
+		FileBuf(const FileBuf&) = delete;
+		FileBuf& operator=(const FileBuf&) = delete;
+		~FileBuf(){
+			try{
+				close();
+			}catch(const std::exception&){
+				//only an explicit close() reports errors
+			}
+			for(char* b : _bufs){
+				free(b);
+			}
+		}
+
+		/* Write out everything and close the file */
+		void close(){
+			if(_fd < 0){
+				return;
+			}
+			try{
+				_send(pptr() - pbase(), true);
+			}catch(const std::exception&){
+				//only for an error of the writer, thrown below once it is stopped
+			}
+			_full.close();
+			_writer.join();
+			::close(_fd);
+			_fd = -1;
+			if(_failed.load()){
+				throw std::runtime_error(_error);
+			}
+		}
+
+	protected:
+		int_type overflow(int_type c) override{
+			_send(pptr() - pbase(), false);
+			if(!traits_type::eq_int_type(c, traits_type::eof())){
+				*pptr() = traits_type::to_char_type(c);
+				pbump(1);
+			}
+			return traits_type::not_eof(c);
+		}
+
+		int sync() override{
+			//direct writes must be whole blocks
+			std::size_t n = pptr() - pbase();
+			_send(_direct ? n & ~(ALIGN-1) : n, false);
+			return 0;
+		}
+
+	private:
+		struct Job{
+			char* buf = nullptr;
+			std::size_t n = 0; // bytes to write
+			bool last = false;
+		};
+		int _fd;
+		char* _bufs[BUFFERS];
+		bool _direct, _drop;
+		off_t _offset; // of the writer
+		SpscRing<Job> _full;
+		SpscRing<char*> _empty;
+		std::thread _writer;
+		std::atomic<bool> _failed;
+		std::string _error; // set before _failed
+
+		/* Queue the first n buffered bytes and carry the rest over to 
+		 * an empty buffer, or queue everything if last */
+		void _send(std::size_t n, bool last){
+			if(_failed.load()){
+				throw std::runtime_error(_error);
+			}
+			if(n == 0 && !last){
+				return;
+			}
+			char* buf = pbase();
+			std::size_t rest = pptr() - pbase() - n;
+			if(!last){
+				char* next = nullptr;
+				if(!_empty.pop(next)){
+					throw std::runtime_error(_failed.load() ? _error : "Writer stopped");
+				}
+				memcpy(next, buf + n, rest);
+				setp(next, next + BUF_SIZE);
+				pbump(rest);
+			}
+			_full.push({buf, n, last});
+		}
+
+		/* The writer thread */
+		void _write_all(){
+			Job j;
+			while(_full.pop(j)){
+				if(!_failed.load()){
+					try{
+						if(j.last && _direct){
+							//the tail need not be aligned
+							fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) & ~O_DIRECT);
+						}
+						_write(j.buf, j.n);
+					}catch(const std::exception &e){
+						_error = e.what();
+						_failed.store(true);
+					}
+				}
+				if(!j.last){
+					_empty.push(j.buf);
+				}
+			}
+			_empty.close();
+		}
+
+		void _write(const char* buf, std::size_t n){
+			STATS(stats::Timer t(stats::local().io_ns));
+			std::size_t done = 0;
+			while(done < n){
+				ssize_t r = ::write(_fd, buf + done, n - done);
+				if(r < 0){
+					if(errno == EINTR){
+						continue;
+					}
+					throw std::runtime_error(std::string() + "Write error: " + strerror(errno));
+				}
+				done += r;
+			}
+			if(_drop && n > 0){
+				posix_fadvise(_fd, _offset, n, POSIX_FADV_DONTNEED);
+			}
+			_offset += n;
+		}
+};
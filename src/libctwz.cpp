@@ -0,0 +1,180 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "libctwz.h"
+#include "ctwz.hpp"
+#include <cstring>
+
+struct ctwz_ctx{
+	std::unique_ptr<StreamEncoder> enc;
+	std::unique_ptr<StreamDecoder> dec;
+	std::string out; // coded but not yet handed out
+	std::size_t out_pos = 0;
+	std::string error;
+
+	/* Hand out what fits of the pending output */
+	long long drain(void* dst, std::size_t cap){
+		std::size_t n = std::min(cap, out.size() - out_pos);
+		memcpy(dst, out.data() + out_pos, n);
+		out_pos += n;
+		if(out_pos == out.size()){
+			out.clear();
+			out_pos = 0;
+		}
+		return n;
+	}
+};
+
+/* Run f, turning exceptions into an error return */
+template<typename F>
+long long guard(ctwz_ctx* ctx, F f){
+	try{
+		ctx->error.clear();
+		return f();
+	}catch(const std::exception &e){
+		ctx->error = e.what();
+		return -1;
+	}
+}
+
+void ctwz_params_init(ctwz_params* params){
+	ModelParams p;
+	params->depth = p.depth;
+	params->mem = p.mem;
+	params->limit = p.limit;
+	params->restart = p.restart;
+	params->shared = p.shared;
+	params->grow = p.grow;
+	params->dict = nullptr;
+	params->chunk_size = DEFAULT_CHUNK_SIZE;
+}
+
+ctwz_ctx* ctwz_compress_new(const ctwz_params* params){
+	ctwz_params defaults;
+	ctwz_params_init(&defaults);
+	if(params == nullptr){
+		params = &defaults;
+	}
+	if(params->depth < 1 || params->depth > MAX_DEPTH || params->chunk_size == 0 
+		|| params->chunk_size > UINT32_MAX/2 || params->grow < 0 || params->grow > 255 || (params->dict && params->mem > 0)){
+		return nullptr;
+	}
+	ModelParams p;
+	p.depth = params->depth;
+	p.mem = params->mem;
+	p.limit = params->limit;
+	p.restart = params->restart;
+	p.shared = params->shared;
+	p.grow = params->grow;
+	try{
+		if(params->dict){
+			//the dictionary sets the model
+			SharedContextTree::DictHeader h = SharedContextTree::read_dict(params->dict);
+			p.depth = h.depth;
+			p.dict_id = h.id;
+			p.dict = params->dict;
+			p.shared = true;
+		}
+		auto ctx = std::make_unique<ctwz_ctx>();
+		ctx->enc = std::make_unique<StreamEncoder>(p, "-", params->chunk_size);
+		return ctx.release();
+	}catch(const std::exception&){
+		return nullptr;
+	}
+}
+
+long long ctwz_compress(ctwz_ctx* ctx, const void* in, size_t in_len, 
+		void* out, size_t out_cap){
+	return guard(ctx, [&]{
+		if(!ctx->enc){
+			throw std::runtime_error("Not a compressor");
+		}
+		if(in_len > 0){
+			ctx->enc->code((const char*)in, in_len, ctx->out);
+		}
+		return ctx->drain(out, out_cap);
+	});
+}
+
+long long ctwz_compress_end(ctwz_ctx* ctx, void* out, size_t out_cap){
+	return guard(ctx, [&]{
+		if(!ctx->enc){
+			throw std::runtime_error("Not a compressor");
+		}
+		ctx->enc->end(ctx->out);
+		return ctx->drain(out, out_cap);
+	});
+}
+
+ctwz_ctx* ctwz_decompress_new(const char* dict){
+	try{
+		auto ctx = std::make_unique<ctwz_ctx>();
+		ctx->dec = std::make_unique<StreamDecoder>(dict);
+		return ctx.release();
+	}catch(const std::exception&){
+		return nullptr;
+	}
+}
+
+long long ctwz_decompress(ctwz_ctx* ctx, const void* in, size_t in_len, 
+		void* out, size_t out_cap){
+	return guard(ctx, [&]{
+		if(!ctx->dec){
+			throw std::runtime_error("Not a decompressor");
+		}
+		if(in_len > 0){
+			ctx->dec->decode((const char*)in, in_len, ctx->out);
+		}
+		return ctx->drain(out, out_cap);
+	});
+}
+
+int ctwz_finished(const ctwz_ctx* ctx){
+	return ctx->dec && ctx->dec->done();
+}
+
+size_t ctwz_pending(const ctwz_ctx* ctx){
+	return ctx->out.size() - ctx->out_pos;
+}
+
+int ctwz_reset(ctwz_ctx* ctx){
+	ctx->out.clear();
+	ctx->out_pos = 0;
+	//the model is rebuilt, which can fail like building it did
+	return guard(ctx, [&]{
+		if(ctx->enc){
+			ctx->enc->reset();
+		}
+		if(ctx->dec){
+			ctx->dec->reset();
+		}
+		return 0;
+	});
+}
+
+const char* ctwz_error(const ctwz_ctx* ctx){
+	return ctx->error.c_str();
+}
+
+void ctwz_free(ctwz_ctx* ctx){
+	delete ctx;
+}
@@ -0,0 +1,89 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+/* C API of ctwz for use in-process. A context compresses or decompresses
+ * one chunked stream (the format of ctwz -c) at a time; any number of
+ * contexts can be used at once, each from one thread at a time. Input 
+ * may be given in pieces of any size. Output that does not fit in 
+ * `out_cap` stays pending in the context until a later call, so a 
+ * caller drains it by calling again with no input while ctwz_pending()
+ * is nonzero. Buffers are kept from call to call and across 
+ * ctwz_reset(). Functions returning long long return -1 on error, 
+ * described by ctwz_error(). */
+
+#include <stddef.h>
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ctwz_ctx ctwz_ctx;
+
+typedef struct{
+	int depth; /* of the context trees, 1 to 64 */
+	size_t mem; /* hashed model budget in MiB, 0 for trees */
+	size_t limit; /* tree model budget in MiB, 0 for no limit */
+	int restart; /* restart the model at the limit instead of pruning */
+	int shared; /* one context trie for all the bit predictors */
+	int grow; /* visits of a context before its path goes deeper, 0 for full paths */
+	const char* dict; /* dictionary from ctwz --train, or NULL */
+	size_t chunk_size; /* most input bytes per chunk */
+} ctwz_params;
+
+/* Set the defaults of ctwz */
+void ctwz_params_init(ctwz_params* params);
+
+/* A compressor with the given parameters, NULL for the defaults. 
+ * Returns NULL if the parameters are invalid. */
+ctwz_ctx* ctwz_compress_new(const ctwz_params* params);
+/* Compress in_len bytes at in, writing at most out_cap bytes to out.
+ * Returns the number of bytes written. */
+long long ctwz_compress(ctwz_ctx* ctx, const void* in, size_t in_len, 
+		void* out, size_t out_cap);
+/* End the stream, writing at most out_cap bytes of it to out. 
+ * Returns the number of bytes written. */
+long long ctwz_compress_end(ctwz_ctx* ctx, void* out, size_t out_cap);
+
+/* A decompressor, dict is the dictionary the streams were coded with 
+ * or NULL. Returns NULL if it can't be made. */
+ctwz_ctx* ctwz_decompress_new(const char* dict);
+/* Decompress in_len bytes at in, writing at most out_cap bytes to out.
+ * Returns the number of bytes written. */
+long long ctwz_decompress(ctwz_ctx* ctx, const void* in, size_t in_len, 
+		void* out, size_t out_cap);
+/* Whether the decompressor has seen the end of the stream */
+int ctwz_finished(const ctwz_ctx* ctx);
+
+/* Bytes of output held back for lack of room */
+size_t ctwz_pending(const ctwz_ctx* ctx);
+/* Start on a new stream with the same settings. Returns 0, or -1 if 
+ * the model could not be rebuilt. */
+int ctwz_reset(ctwz_ctx* ctx);
+/* Description of the last error, "" if none */
+const char* ctwz_error(const ctwz_ctx* ctx);
+void ctwz_free(ctwz_ctx* ctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,144 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+/* ctwz_pool_bench measures task throughput of the thread pools: the 
+ * work-stealing executor that codes blocks and the older queue based 
+ * ThreadPoolExecutor. "flat" submits every task from the main thread, 
+ * "split" has tasks submit two halves of themselves from the workers 
+ * down to single leaves, as fine-grained parallel code would, so it 
+ * runs 2n-1 tasks for n. Leaves spin for a given number of iterations.
+ * Prints CSV of the best of a few runs. */
+
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include "thread_pool_executor.hpp"
+#include "work_stealing.hpp"
+
+/* About `work` iterations of dependent arithmetic */
+void spin(int work){
+	static std::atomic<uint64_t> sink;
+	uint64_t x = work;
+	for(int i=0; i<work; ++i){
+		x = x*6364136223846793005ULL + 1442695040888963407ULL;
+	}
+	sink.fetch_add(x, std::memory_order_relaxed);
+}
+
+/* Run the tasks of a scenario on a pool and return the seconds taken.
+ * Every task counts itself done as the last thing it does. */
+template<typename Pool>
+double run(Pool &pool, bool split, long tasks, int work){
+	std::atomic<long> done(0);
+	std::function<void(long)> part;
+	auto start = std::chrono::steady_clock::now();
+	if(split){
+		//a task for n leaves submits tasks for n/2 and n - n/2 of them
+		part = [&](long n){
+			if(n == 1){
+				spin(work);
+			}else{
+				pool.submit([&part,n]{ part(n/2); });
+				pool.submit([&part,n]{ part(n - n/2); });
+			}
+			done.fetch_add(1, std::memory_order_release);
+		};
+		pool.submit([&part,tasks]{ part(tasks); });
+		tasks = 2*tasks - 1;
+	}else{
+		for(long i=0; i<tasks; ++i){
+			pool.submit([&done,work]{
+				spin(work);
+				done.fetch_add(1, std::memory_order_release);
+			});
+		}
+	}
+	while(done.load(std::memory_order_acquire) < tasks){
+		std::this_thread::yield();
+	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void usage(){
+	std::cout << "ctwz_pool_bench:\n"
+		<< "\tTask throughput of the thread pools\n"
+		<< "usage:\n" 
+		<< "\tctwz_pool_bench [-j 1,2,4] [-n tasks] [-w work] [-r repeats] [--pin]" << std::endl;
+	exit(0);
+}
+
+int main(int argc, char* argv[]){
+	std::vector<int> jobs = {1, 2, 4};
+	long tasks = 200000;
+	int work = 100, repeats = 3;
+	bool pin = false;
+	for(int i=1; i<argc; ++i){
+		if(strcmp(argv[i],"-j")==0 && i+1<argc){
+			jobs.clear();
+			std::istringstream js(argv[++i]);
+			std::string j;
+			while(std::getline(js, j, ',')){
+				jobs.push_back(std::max(1, atoi(j.c_str())));
+			}
+		}else if(strcmp(argv[i],"-n")==0 && i+1<argc){
+			tasks = std::max(1L, atol(argv[++i]));
+		}else if(strcmp(argv[i],"-w")==0 && i+1<argc){
+			work = atoi(argv[++i]);
+		}else if(strcmp(argv[i],"-r")==0 && i+1<argc){
+			repeats = std::max(1, atoi(argv[++i]));
+		}else if(strcmp(argv[i],"--pin")==0){
+			pin = true;
+		}else{
+			usage();
+		}
+	}
+	std::cout << "pool,scenario,threads,tasks,work,seconds,mtasks_per_s" << std::endl;
+	for(int j : jobs){
+		for(bool split : {false, true}){
+			//best of the repeats, each on a fresh pool
+			double queue = 1e30, steal = 1e30;
+			for(int r=0; r<repeats; ++r){
+				{
+					ThreadPoolExecutor pool(j, j, 100ms);
+					queue = std::min(queue, run(pool, split, tasks, work));
+					pool.shutdown();
+					pool.wait();
+				}
+				{
+					WorkStealingExecutor pool(j, pin);
+					steal = std::min(steal, run(pool, split, tasks, work));
+				}
+			}
+			const char* scenario = split ? "split" : "flat";
+			for(auto [name, s] : {std::pair<const char*, double>{"queue", queue}, {"steal", steal}}){
+				std::cout << name << "," << scenario << "," << j << "," << tasks << "," 
+					<< work << "," << s << "," << (split ? 2*tasks - 1 : tasks)/s/1e6 << std::endl;
+			}
+		}
+	}
+}
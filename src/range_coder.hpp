@@ -0,0 +1,132 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include "stats.hpp"
+
+#pragma once
+
+/* Binary range coder with 32-bit precision. The interval [low, high] is 
+ * split by the probability of a zero; once the top bytes of low and high
+ * agree that byte is settled and shifted out, so there is never a carry.
+ * Probabilities have `bits` fraction bits. Each coder keeps its own 
+ * state and buffer, so any number of them can run at once. */
+class RangeEncoder{
+	public:
+		static const std::size_t BUF_SIZE = 1 << 16;
+
+		RangeEncoder(std::ostream &out) : _out(out), _low(0), _high(0xffffffff), _flushed(0){
+			_buf.reserve(BUF_SIZE);
+		}
+
+		void encode(bool b, uint32_t p0, int bits){
+			STATS(stats::Timer t(stats::local().code_ns));
+			uint32_t mid = _low + (((uint64_t)(_high - _low)*p0) >> bits);
+			if(b){
+				_low = mid + 1;
+			}else{
+				_high = mid;
+			}
+			while(((_low ^ _high) & 0xff000000) == 0){
+				_put(_high >> 24);
+				_low <<= 8;
+				_high = (_high << 8) | 0xff;
+			}
+		}
+
+		/* Bytes produced so far */
+		long long bytes() const{
+			return _flushed + _buf.size();
+		}
+
+		/* End the stream with one byte that, followed by zeros, 
+		 * lies inside the final interval */
+		void flush(){
+			_put((_low >> 24) + 1);
+			_write();
+		}
+
+	private:
+		std::ostream &_out;
+		std::vector<char> _buf;
+		uint32_t _low, _high;
+		long long _flushed;
+
+		void _put(uint8_t c){
+			_buf.push_back((char)c);
+			if(_buf.size() >= BUF_SIZE){
+				_write();
+			}
+		}
+
+		void _write(){
+			_out.write(_buf.data(), _buf.size());
+			_flushed += _buf.size();
+			_buf.clear();
+		}
+};
+
+/* Decoder for RangeEncoder reading the coded bytes from memory,
+ * it reads zeros past the end */
+class RangeDecoder{
+	public:
+		RangeDecoder(const char* data, std::size_t size) : _pos(data), _end(data + size),
+			_low(0), _high(0xffffffff), _code(0){
+			for(int i=0; i<4; ++i){
+				_code = (_code << 8) | _get();
+			}
+		}
+
+		bool decode(uint32_t p0, int bits){
+			STATS(stats::Timer t(stats::local().code_ns));
+			uint32_t mid = _low + (((uint64_t)(_high - _low)*p0) >> bits);
+			bool b = _code > mid;
+			if(b){
+				_low = mid + 1;
+			}else{
+				_high = mid;
+			}
+			while(((_low ^ _high) & 0xff000000) == 0){
+				_low <<= 8;
+				_high = (_high << 8) | 0xff;
+				_code = (_code << 8) | _get();
+			}
+			return b;
+		}
+
+		/* Next byte to read */
+		const char* pos() const{ return _pos; }
+
+	private:
+		const char* _pos;
+		const char* _end;
+		uint32_t _low, _high, _code;
+
+		uint8_t _get(){
+			return _pos < _end ? *_pos++ : 0;
+		}
+};
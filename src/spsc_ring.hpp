@@ -0,0 +1,125 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+#pragma once
+
+/* Bounded ring between one producer thread and one consumer thread.
+ * Each side only writes its own index, so passing an item takes no 
+ * lock. A side that has to wait spins a little and then sleeps; the 
+ * mutex is only taken to sleep or to wake a sleeper. Meant for a few 
+ * large items such as buffers of I/O, not for fine-grained traffic. */
+template<typename T>
+class SpscRing{
+	public:
+		SpscRing(std::size_t cap) : _items(cap ? cap : 1), _head(0), _tail(0), 
+			_closed(false), _sleeping(0){}
+		SpscRing(const SpscRing&) = delete;
+		SpscRing& operator=(const SpscRing&) = delete;
+
+		/* Producer: wait for room and add x, false if closed */
+		bool push(T x){
+			std::size_t tail = _tail.load(std::memory_order_relaxed);
+			_wait([&]{ return tail - _head.load() < _items.size() || _closed.load(); });
+			if(_closed.load()){
+				return false;
+			}
+			_items[tail % _items.size()] = std::move(x);
+			_tail.store(tail + 1);
+			_wake();
+			return true;
+		}
+
+		/* Consumer: wait for an item, false once closed and empty */
+		bool pop(T &x){
+			std::size_t head = _head.load(std::memory_order_relaxed);
+			_wait([&]{ return _tail.load() != head || _closed.load(); });
+			return _take(head, x);
+		}
+
+		/* Consumer: an item if one is ready */
+		bool try_pop(T &x){
+			std::size_t head = _head.load(std::memory_order_relaxed);
+			return _tail.load() != head && _take(head, x);
+		}
+
+		/* No more pushes; pop still drains what is in the ring */
+		void close(){
+			_closed.store(true);
+			std::lock_guard<std::mutex> lock(_mx);
+			_cv.notify_all();
+		}
+
+	private:
+		std::vector<T> _items;
+		alignas(64) std::atomic<std::size_t> _head; // next to pop
+		alignas(64) std::atomic<std::size_t> _tail; // next to push
+		std::atomic<bool> _closed;
+		std::atomic<int> _sleeping;
+		std::mutex _mx;
+		std::condition_variable _cv;
+
+		static const int SPINS = 64;
+
+		bool _take(std::size_t head, T &x){
+			if(_tail.load() == head){
+				return false;
+			}
+			x = std::move(_items[head % _items.size()]);
+			_head.store(head + 1);
+			_wake();
+			return true;
+		}
+
+		template<typename P>
+		void _wait(P ready){
+			for(int i=0; i<SPINS; ++i){
+				if(ready()){
+					return;
+				}
+				std::this_thread::yield();
+			}
+			//a waker that moved an index before this shows up in ready(),
+			//one that moves it after sees _sleeping
+			_sleeping.fetch_add(1);
+			{
+				std::unique_lock<std::mutex> lock(_mx);
+				_cv.wait(lock, ready);
+			}
+			_sleeping.fetch_sub(1);
+		}
+
+		void _wake(){
+			if(_sleeping.load() > 0){
+				std::lock_guard<std::mutex> lock(_mx);
+				_cv.notify_all();
+			}
+		}
+};
@@ -0,0 +1,165 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <cstdint>
+
+#pragma once
+
+/* Hot path counters and timers exist only in builds with CTWZ_STATS
+ * (cmake -DCTWZ_STATS=ON), elsewhere STATS(...) expands to nothing. */
+#ifdef CTWZ_STATS
+#define STATS(x) x
+#else
+#define STATS(x)
+#endif
+
+namespace stats{
+
+struct Counters{
+	uint64_t predict_ns = 0, commit_ns = 0, code_ns = 0, io_ns = 0;
+	uint64_t updates = 0, rescales = 0;
+
+	void add(const Counters &o){
+		predict_ns += o.predict_ns, commit_ns += o.commit_ns;
+		code_ns += o.code_ns, io_ns += o.io_ns;
+		updates += o.updates, rescales += o.rescales;
+	}
+};
+
+/* Shape of the models at the end of coding, summed over all models */
+struct Census{
+	uint64_t models = 0;
+	uint64_t bytes = 0; // model memory
+	std::vector<uint64_t> per_depth; // context nodes at each depth
+	std::vector<uint64_t> per_tree; // context nodes of each AsciiTree node, heap order
+};
+
+inline bool enabled = false; // set by --stats
+inline std::mutex lock;
+inline Counters retired; // of threads that have exited
+inline std::set<Counters*> live;
+inline Census census;
+
+/* Each thread counts on its own and hands its counts over on exit */
+struct Local{
+	Counters c;
+	Local(){
+		std::lock_guard<std::mutex> g(lock);
+		live.insert(&c);
+	}
+	~Local(){
+		std::lock_guard<std::mutex> g(lock);
+		retired.add(c);
+		live.erase(&c);
+	}
+};
+
+inline Counters& local(){
+	static thread_local Local l;
+	return l.c;
+}
+
+inline Counters total(){
+	std::lock_guard<std::mutex> g(lock);
+	Counters t = retired;
+	for(Counters* c : live){
+		t.add(*c);
+	}
+	return t;
+}
+
+inline void add_census(const Census &c){
+	std::lock_guard<std::mutex> g(lock);
+	census.models += c.models;
+	census.bytes += c.bytes;
+	auto sum = [](std::vector<uint64_t> &to, const std::vector<uint64_t> &from){
+		if(to.size() < from.size()){
+			to.resize(from.size());
+		}
+		for(std::size_t i=0; i<from.size(); ++i){
+			to[i] += from[i];
+		}
+	};
+	sum(census.per_depth, c.per_depth);
+	sum(census.per_tree, c.per_tree);
+}
+
+/* Adds the time until it goes out of scope to `ns` */
+class Timer{
+	public:
+		Timer(uint64_t &ns) : _ns(ns), _start(std::chrono::steady_clock::now()){}
+		~Timer(){
+			_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - _start).count();
+		}
+	private:
+		uint64_t &_ns;
+		std::chrono::steady_clock::time_point _start;
+};
+
+/* Write the statistics of a run as JSON */
+inline void report(std::ostream &os, long long in_bytes, long long coded_bytes, double seconds){
+	Counters t = total();
+	os << "{\n  \"input_bytes\": " << in_bytes 
+		<< ",\n  \"coded_bytes\": " << coded_bytes
+		<< ",\n  \"bits_per_byte\": " << (in_bytes ? 8.0*coded_bytes/in_bytes : 0)
+		<< ",\n  \"seconds\": " << seconds;
+#ifdef CTWZ_STATS
+	os << ",\n  \"time_ns\": {\"predict\": " << t.predict_ns << ", \"commit\": " << t.commit_ns
+		<< ", \"code\": " << t.code_ns << ", \"io\": " << t.io_ns << "}"
+		<< ",\n  \"updates\": " << t.updates
+		<< ",\n  \"rescales\": " << t.rescales;
+#else
+	(void)t;
+	os << ",\n  \"time_ns\": null";
+#endif
+	os << ",\n  \"models\": " << census.models 
+		<< ",\n  \"model_bytes\": " << census.bytes
+		<< ",\n  \"nodes_per_depth\": [";
+	for(std::size_t i=0; i<census.per_depth.size(); ++i){
+		os << (i ? ", " : "") << census.per_depth[i];
+	}
+	//AsciiTree nodes by their bit prefix
+	os << "],\n  \"nodes_per_tree\": {";
+	bool first = true;
+	for(std::size_t i=1; i<census.per_tree.size(); ++i){
+		if(census.per_tree[i] == 0){
+			continue;
+		}
+		std::string prefix;
+		for(std::size_t j=i; j>1; j/=2){
+			prefix.insert(prefix.begin(), '0' + (j&1));
+		}
+		os << (first ? "" : ", ") << "\"" << prefix << "\": " << census.per_tree[i];
+		first = false;
+	}
+	os << "}\n}" << std::endl;
+}
+
+}
@@ -18,8 +18,8 @@ public:
     ThreadPoolExecutor(size_t pool_size, size_t max_pool_size = 0, std::chrono::milliseconds keep_alive_time = 0s, size_t max_queue_size = std::numeric_limits<size_t>::max()):
         pool_size(pool_size),
         max_pool_size(max_pool_size ? max_pool_size : pool_size),
-        keep_alive_time(keep_alive_time),
         max_queue_size(max_queue_size),
+        keep_alive_time(keep_alive_time),
         queue(max_queue_size)
     {
         for (size_t i = 0; i < pool_size; ++i) {
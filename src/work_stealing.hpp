@@ -0,0 +1,321 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#pragma once
+
+/* Chase-Lev work-stealing deque of pointers. The owning thread pushes 
+ * and takes at the bottom, any other thread steals from the top. Only 
+ * the last item is contended, which is settled by a CAS on top. The 
+ * ring doubles when full; old rings are kept until the deque is gone
+ * since a thief may still be reading one. */
+template<typename T>
+class WorkDeque{
+	public:
+		WorkDeque(int log_cap = 8) : _top(0), _bottom(0){
+			_rings.emplace_back(new Ring(log_cap));
+			_ring.store(_rings.back().get(), std::memory_order_relaxed);
+		}
+		WorkDeque(const WorkDeque&) = delete;
+		WorkDeque& operator=(const WorkDeque&) = delete;
+
+		/* Owner only */
+		void push(T* x){
+			int64_t b = _bottom.load(std::memory_order_relaxed);
+			int64_t t = _top.load(std::memory_order_acquire);
+			Ring* r = _ring.load(std::memory_order_relaxed);
+			if(b - t > r->mask){
+				r = _grow(r, t, b);
+			}
+			r->put(b, x);
+			std::atomic_thread_fence(std::memory_order_release);
+			_bottom.store(b + 1, std::memory_order_relaxed);
+		}
+
+		/* Owner only, the most recently pushed item or nullptr */
+		T* take(){
+			int64_t b = _bottom.load(std::memory_order_relaxed) - 1;
+			Ring* r = _ring.load(std::memory_order_relaxed);
+			_bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t t = _top.load(std::memory_order_relaxed);
+			T* x = nullptr;
+			if(t <= b){
+				x = r->get(b);
+				if(t == b){
+					//last item, race the thieves for it
+					if(!_top.compare_exchange_strong(t, t + 1, 
+							std::memory_order_seq_cst, std::memory_order_relaxed)){
+						x = nullptr;
+					}
+					_bottom.store(b + 1, std::memory_order_relaxed);
+				}
+			}else{
+				_bottom.store(b + 1, std::memory_order_relaxed);
+			}
+			return x;
+		}
+
+		/* Any thread, the oldest item or nullptr if empty or lost a race */
+		T* steal(){
+			int64_t t = _top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t b = _bottom.load(std::memory_order_acquire);
+			if(t >= b){
+				return nullptr;
+			}
+			T* x = _ring.load(std::memory_order_acquire)->get(t);
+			if(!_top.compare_exchange_strong(t, t + 1, 
+					std::memory_order_seq_cst, std::memory_order_relaxed)){
+				return nullptr;
+			}
+			return x;
+		}
+
+		bool empty() const{
+			return _top.load(std::memory_order_relaxed) >= 
+				_bottom.load(std::memory_order_relaxed);
+		}
+
+	private:
+		struct Ring{
+			int64_t mask;
+			std::unique_ptr<std::atomic<T*>[]> items;
+			Ring(int log_cap) : mask(((int64_t)1 << log_cap) - 1), 
+				items(new std::atomic<T*>[mask + 1]){}
+			T* get(int64_t i) const{ return items[i & mask].load(std::memory_order_relaxed); }
+			void put(int64_t i, T* x){ items[i & mask].store(x, std::memory_order_relaxed); }
+		};
+		//top and bottom on their own cache lines, thieves only write top
+		alignas(64) std::atomic<int64_t> _top;
+		alignas(64) std::atomic<int64_t> _bottom;
+		std::atomic<Ring*> _ring;
+		std::vector<std::unique_ptr<Ring>> _rings;
+
+		Ring* _grow(Ring* r, int64_t t, int64_t b){
+			int log_cap = __builtin_ctzll(r->mask + 1) + 1;
+			_rings.emplace_back(new Ring(log_cap));
+			Ring* bigger = _rings.back().get();
+			for(int64_t i=t; i<b; ++i){
+				bigger->put(i, r->get(i));
+			}
+			_ring.store(bigger, std::memory_order_release);
+			return bigger;
+		}
+};
+
+/* Thread pool where every worker has a WorkDeque. Tasks submitted by a 
+ * worker go to its own deque, others to a lock-free inbox stack that an 
+ * idle worker empties into its deque. Idle workers steal from the 
+ * others before they sleep. The hot path takes no locks and throws no 
+ * exceptions; a mutex is only taken to put a worker to sleep or wake 
+ * one, so tasks must not throw (see submit_task in ctwz.cpp for 
+ * results and errors through futures). With `pin`, worker i is bound 
+ * to core i modulo the number of cores, on Linux. */
+class WorkStealingExecutor{
+	public:
+		WorkStealingExecutor(int workers, bool pin = false) : 
+				_inbox(nullptr), _pending(0), _epoch(0), _sleeping(0), _stop(false){
+			if(workers < 1){
+				workers = 1;
+			}
+			for(int i=0; i<workers; ++i){
+				_deques.emplace_back(new WorkDeque<Task>());
+			}
+			for(int i=0; i<workers; ++i){
+				_threads.emplace_back(&WorkStealingExecutor::_work, this, i);
+				if(pin){
+					_pin(_threads.back(), i);
+				}
+			}
+		}
+		WorkStealingExecutor(const WorkStealingExecutor&) = delete;
+		WorkStealingExecutor& operator=(const WorkStealingExecutor&) = delete;
+
+		/* Finishes the tasks submitted so far */
+		~WorkStealingExecutor(){
+			wait();
+			_stop.store(true);
+			{
+				std::lock_guard<std::mutex> lock(_sleep_mx);
+				_sleep_cv.notify_all();
+			}
+			for(std::thread &t : _threads){
+				t.join();
+			}
+		}
+
+		template<typename F>
+		void submit(F func){
+			Task* task = new Task{std::move(func), nullptr};
+			_pending.fetch_add(1, std::memory_order_relaxed);
+			if(_self.pool == this){
+				_deques[_self.index]->push(task);
+			}else{
+				task->next = _inbox.load(std::memory_order_relaxed);
+				while(!_inbox.compare_exchange_weak(task->next, task, 
+						std::memory_order_release, std::memory_order_relaxed));
+			}
+			_wake();
+		}
+
+		/* Block until every submitted task has run */
+		void wait(){
+			std::unique_lock<std::mutex> lock(_done_mx);
+			_done_cv.wait(lock, [this]{ return _pending.load() == 0; });
+		}
+
+		int size() const{ return _threads.size(); }
+
+	private:
+		struct Task{
+			std::function<void()> func;
+			Task* next; // in the inbox
+		};
+		//the pool and deque of a worker thread, zero elsewhere
+		struct Self{
+			WorkStealingExecutor* pool;
+			int index;
+		};
+		static inline thread_local Self _self;
+
+		std::vector<std::unique_ptr<WorkDeque<Task>>> _deques;
+		std::vector<std::thread> _threads;
+		std::atomic<Task*> _inbox;
+		std::atomic<int64_t> _pending; // submitted and not finished
+		std::atomic<uint64_t> _epoch; // bumped by every submit
+		std::atomic<int> _sleeping;
+		std::atomic<bool> _stop;
+		std::mutex _sleep_mx, _done_mx;
+		std::condition_variable _sleep_cv, _done_cv;
+
+		static const int SPINS = 64;
+
+		void _wake(){
+			_epoch.fetch_add(1);
+			if(_sleeping.load() > 0){
+				std::lock_guard<std::mutex> lock(_sleep_mx);
+				_sleep_cv.notify_one();
+			}
+		}
+
+		/* Own deque, then the inbox, then the other deques */
+		Task* _find(int i){
+			WorkDeque<Task> &own = *_deques[i];
+			if(Task* t = own.take()){
+				return t;
+			}
+			if(_inbox.load(std::memory_order_relaxed)){
+				Task* list = _inbox.exchange(nullptr, std::memory_order_acquire);
+				//the stack is newest first: push so that the oldest is 
+				//taken next and thieves get the newest
+				Task* first = nullptr;
+				for(Task* t = list; t; ){
+					Task* next = t->next;
+					if(next){
+						own.push(t);
+					}else{
+						first = t;
+					}
+					t = next;
+				}
+				if(first){
+					return first;
+				}
+			}
+			int n = _deques.size();
+			for(int k=1; k<n; ++k){
+				if(Task* t = _deques[(i + k) % n]->steal()){
+					return t;
+				}
+			}
+			return nullptr;
+		}
+
+		void _run(Task* t){
+			t->func();
+			delete t;
+			if(_pending.fetch_sub(1, std::memory_order_acq_rel) == 1){
+				std::lock_guard<std::mutex> lock(_done_mx);
+				_done_cv.notify_all();
+			}
+		}
+
+		void _work(int i){
+			_self.pool = this;
+			_self.index = i;
+			int idle = 0;
+			while(true){
+				uint64_t epoch = _epoch.load();
+				if(Task* t = _find(i)){
+					_run(t);
+					idle = 0;
+					continue;
+				}
+				if(_stop.load()){
+					break;
+				}
+				if(++idle < SPINS){
+					std::this_thread::yield();
+					continue;
+				}
+				//nothing found since epoch: sleep until a submit
+				_sleeping.fetch_add(1);
+				{
+					std::unique_lock<std::mutex> lock(_sleep_mx);
+					_sleep_cv.wait(lock, [&]{ 
+						return _epoch.load() != epoch || _stop.load(); 
+					});
+				}
+				_sleeping.fetch_sub(1);
+				idle = 0;
+			}
+			_self.pool = nullptr;
+		}
+
+		static void _pin(std::thread &t, int i){
+#ifdef __linux__
+			int cores = std::thread::hardware_concurrency();
+			if(cores > 0){
+				cpu_set_t set;
+				CPU_ZERO(&set);
+				CPU_SET(i % cores, &set);
+				pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+			}
+#else
+			(void)t; (void)i;
+#endif
+		}
+};
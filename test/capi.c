@@ -0,0 +1,210 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+/* Round trips through the C API of libctwz: input in uneven pieces, 
+ * output buffers too small for it so ctwz_pending has to be drained, 
+ * contexts reused with ctwz_reset, and the errors it reports. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libctwz.h"
+
+static int failed = 0;
+
+#define CHECK(c) do{ if(!(c)){ fprintf(stderr, "%s:%d: FAILED %s\n", __FILE__, __LINE__, #c); ++failed; } }while(0)
+
+/* Append up to cap bytes of output, calling f until nothing is pending */
+typedef long long (*Step)(ctwz_ctx*, const void*, size_t, void*, size_t);
+
+static long long drain(ctwz_ctx* ctx, Step f, const char* in, size_t n, 
+		char* out, size_t have, size_t size, size_t cap){
+	long long r = f(ctx, in, n, out + have, cap < size - have ? cap : size - have);
+	if(r < 0){
+		return -1;
+	}
+	have += r;
+	while(ctwz_pending(ctx) > 0 && have < size){
+		r = f(ctx, NULL, 0, out + have, cap < size - have ? cap : size - have);
+		if(r < 0){
+			return -1;
+		}
+		have += r;
+	}
+	return have;
+}
+
+static long long compress_end(ctwz_ctx* ctx, const void* in, size_t n, void* out, size_t cap){
+	(void)in;
+	(void)n;
+	return ctwz_compress_end(ctx, out, cap);
+}
+
+/* Compress data in pieces of 1, 2, 3... bytes with output buffers of 
+ * cap bytes, returns the size of the stream in z or -1 */
+static long long compress(ctwz_ctx* c, const char* data, size_t n, char* z, size_t size, size_t cap){
+	long long have = 0;
+	size_t step = 1;
+	for(size_t pos = 0; pos < n; pos += step, ++step){
+		size_t len = step < n - pos ? step : n - pos;
+		have = drain(c, ctwz_compress, data + pos, len, z, have, size, cap);
+		if(have < 0){
+			return -1;
+		}
+	}
+	have = drain(c, compress_end, NULL, 0, z, have, size, cap);
+	if(have < 0){
+		return -1;
+	}
+	//the end may not fit either
+	while(ctwz_pending(c) > 0 && (size_t)have < size){
+		long long r = ctwz_compress_end(c, z + have, cap);
+		if(r < 0){
+			return -1;
+		}
+		have += r;
+	}
+	return have;
+}
+
+/* Decompress the stream in pieces of 7 bytes */
+static long long decompress(ctwz_ctx* d, const char* z, size_t n, char* out, size_t size, size_t cap){
+	long long have = 0;
+	for(size_t pos = 0; pos < n; pos += 7){
+		size_t len = 7 < n - pos ? 7 : n - pos;
+		have = drain(d, ctwz_decompress, z + pos, len, out, have, size, cap);
+		if(have < 0){
+			return -1;
+		}
+	}
+	return have;
+}
+
+static void roundtrip(ctwz_ctx* c, ctwz_ctx* d, const char* data, size_t n, size_t cap){
+	size_t size = 2*n + 1024;
+	char* z = malloc(size);
+	char* out = malloc(n + 1);
+	long long zn = compress(c, data, n, z, size, cap);
+	CHECK(zn > 0);
+	long long m = zn > 0 ? decompress(d, z, zn, out, n + 1, cap) : -1;
+	CHECK(m == (long long)n);
+	CHECK(m == (long long)n && memcmp(out, data, n) == 0);
+	CHECK(ctwz_finished(d));
+	CHECK(ctwz_pending(c) == 0 && ctwz_pending(d) == 0);
+	free(z);
+	free(out);
+}
+
+/* Decompress a stream of the given version and header line that ends 
+ * before any chunk, returns what ctwz_decompress does */
+static long long with_header(ctwz_ctx* d, const char* version, const char* line){
+	char z[512], out[64];
+	int n = snprintf(z, sizeof(z) - 4, "%s\n%s\n", version, line);
+	memset(z + n, 0, 4);
+	CHECK(ctwz_reset(d) == 0);
+	return ctwz_decompress(d, z, n + 4, out, sizeof(out));
+}
+
+int main(void){
+	size_t n = 30000;
+	char* text = malloc(n);
+	unsigned s = 1;
+	for(size_t i=0; i<n; ++i){
+		s = s*1103515245 + 12345;
+		text[i] = "abc de\nfghij klm"[(s >> 16) % 16];
+	}
+
+	ctwz_params p;
+	ctwz_params_init(&p);
+	p.depth = 6;
+	p.chunk_size = 1000;
+	ctwz_ctx* c = ctwz_compress_new(&p);
+	ctwz_ctx* d = ctwz_decompress_new(NULL);
+	CHECK(c && d);
+	if(!c || !d){
+		return 1;
+	}
+	roundtrip(c, d, text, n, 1 << 16);
+	//out_cap far below a chunk keeps output pending
+	CHECK(ctwz_reset(c) == 0 && ctwz_reset(d) == 0);
+	roundtrip(c, d, text, n, 5);
+	//shorter than the initial context, and empty
+	CHECK(ctwz_reset(c) == 0 && ctwz_reset(d) == 0);
+	roundtrip(c, d, text, 3, 2);
+	CHECK(ctwz_reset(c) == 0 && ctwz_reset(d) == 0);
+	roundtrip(c, d, text, 0, 2);
+	ctwz_free(c);
+
+	//a hashed, shared model with the defaults otherwise
+	ctwz_params_init(&p);
+	p.mem = 1;
+	p.shared = 1;
+	c = ctwz_compress_new(&p);
+	CHECK(c != NULL && ctwz_reset(d) == 0);
+	if(c){
+		roundtrip(c, d, text, n, 100);
+		ctwz_free(c);
+	}
+
+	//errors
+	ctwz_params_init(&p);
+	p.depth = 0;
+	CHECK(ctwz_compress_new(&p) == NULL);
+	ctwz_params_init(&p);
+	p.dict = "/nonexistent/ctwz.dict";
+	CHECK(ctwz_compress_new(&p) == NULL);
+	char out[64];
+	CHECK(ctwz_compress(d, text, 10, out, sizeof(out)) == -1);
+	CHECK(strlen(ctwz_error(d)) > 0);
+	CHECK(ctwz_reset(d) == 0 && strlen(ctwz_error(d)) == 0);
+	CHECK(ctwz_decompress(d, "not a ctwz stream\n\n\n", 20, out, sizeof(out)) == -1);
+	CHECK(strlen(ctwz_error(d)) > 0);
+
+	//headers of models ctwz doesn't make, in the version it writes
+	char version[256] = "";
+	c = ctwz_compress_new(NULL);
+	if(c && ctwz_compress_end(c, version, sizeof(version) - 1) > 0){
+		*strchr(version, '\n') = 0;
+	}
+	ctwz_free(c);
+	CHECK(with_header(d, version, "\"-\" 8 -1 1000 0 0 0 0 0 0 -") == 0 && ctwz_finished(d));
+	CHECK(with_header(d, version, "\"-\" 200 -1 1000 0 0 0 0 0 0 -") == -1);
+	CHECK(with_header(d, version, "\"-\" 0 -1 1000 0 0 0 0 0 0 -") == -1);
+	CHECK(with_header(d, version, "\"-\" 8 -1 1000 0 0 0 0 0 300 -") == -1);
+	CHECK(with_header(d, version, "\"-\" 8 -1 1000 0 0 0 0 0 0 0123") == -1);
+	CHECK(with_header(d, version, "\"-\" 8 -1 1000 99999999999 0 0 0 0 0 -") == -1);
+	CHECK(with_header(d, version, "\"-\" 8 -1 4294967295 0 0 0 0 0 0 -") == -1);
+	//malformed headers
+	CHECK(with_header(d, version, "\"-\" 8 -1 1000") == -1);
+	CHECK(with_header(d, version, "\"-\" 8 x 1000 0 0 0 0 0 0 -") == -1);
+	CHECK(with_header(d, version, "\"-\" 8 -1 1000 0 0 0 0 0 0 - 1") == -1);
+	CHECK(with_header(d, version, "\"../x\" 8 -1 1000 0 0 0 0 0 0 -") == -1);
+	CHECK(with_header(d, version, "\"-\" 8 -1 1000 0 0 0 0 0 0") == -1);
+	ctwz_free(d);
+
+	free(text);
+	if(failed == 0){
+		printf("ok\n");
+	}
+	return failed ? 1 : 0;
+}
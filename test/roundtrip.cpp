@@ -0,0 +1,260 @@
+/*
+* Copyright (c) 2021 Meijke Balay 
+* 
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+* the Software, and to permit persons to whom the Software is furnished to do so,
+* subject to the following conditions:
+* 
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+* 
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+* FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+* COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+* IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+* CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+
+/* ctwz_roundtrip codes generated inputs with the ctwz executable in one 
+ * mode and checks that they decode to the same bytes. Each mode is a 
+ * test of CMake's ctest, see CMakeLists.txt. The inputs are empty, one 
+ * byte, every byte value, skewed binary and text. */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+namespace fs = std::filesystem;
+
+struct Input{
+	std::string name;
+	std::string data;
+};
+
+/* Inputs are made with a fixed seed, so every run codes the same bytes */
+struct Rand{
+	uint64_t s = 0x9E3779B97F4A7C15ULL;
+	uint32_t operator()(uint32_t n){
+		s = s*6364136223846793005ULL + 1442695040888963407ULL;
+		return (s >> 33) % n;
+	}
+};
+
+std::string text(std::size_t n, Rand &r){
+	static const char* words[] = {"the", "context", "tree", "weighting", "of", "a", 
+		"binary", "source", "with", "memory", "and", "depth", "{\"id\":", "\"name\":", 
+		"12", "345", "\n", "\t", "-", "Vim", "buffer", "window", "is", "to", "in"};
+	std::string s;
+	while(s.size() < n){
+		s += words[r(sizeof(words)/sizeof(*words))];
+		s += r(8) ? " " : ".\n";
+	}
+	s.resize(n);
+	return s;
+}
+
+std::vector<Input> inputs(){
+	Rand r;
+	std::vector<Input> in = {{"empty", ""}, {"one byte", "x"}};
+	std::string all;
+	for(int i=0; i<512; ++i){
+		all += (char)i;
+	}
+	in.push_back({"all", all});
+	std::string bin;
+	for(int i=0; i<12000; ++i){
+		//mostly a few values, some noise
+		bin += (char)(r(4) ? r(4)*17 : r(256));
+	}
+	in.push_back({"bin", bin});
+	in.push_back({"text", text(40000, r)});
+	return in;
+}
+
+/* Run a command with stdin from `in` and stdout to `out`, true if it 
+ * exits with 0 */
+bool run(const std::vector<std::string> &args, const std::string &in = "/dev/null",
+		const std::string &out = "/dev/null"){
+	pid_t pid = fork();
+	if(pid < 0){
+		return false;
+	}
+	if(pid == 0){
+		int ifd = open(in.c_str(), O_RDONLY);
+		int ofd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(ifd < 0 || ofd < 0){
+			_exit(127);
+		}
+		dup2(ifd, 0);
+		dup2(ofd, 1);
+		std::vector<char*> argv;
+		for(const std::string &a : args){
+			argv.push_back(const_cast<char*>(a.c_str()));
+		}
+		argv.push_back(nullptr);
+		execv(argv[0], argv.data());
+		_exit(127);
+	}
+	int status;
+	if(waitpid(pid, &status, 0) < 0){
+		return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+std::string read_file(const fs::path &p){
+	std::ifstream f(p, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+void write_file(const fs::path &p, const std::string &data){
+	std::ofstream f(p, std::ios::binary);
+	f.write(data.data(), data.size());
+}
+
+std::vector<std::string> cat(std::vector<std::string> a, const std::vector<std::string> &b){
+	a.insert(a.end(), b.begin(), b.end());
+	return a;
+}
+
+struct Test{
+	std::string ctwz;
+	std::vector<std::string> enc, dec; // options of the encoder and decoder
+	int failed = 0;
+
+	void check(bool ok, const Input &in, const std::string &what){
+		if(!ok){
+			std::cerr << "FAILED " << in.name << " (" << in.data.size() << " bytes): " 
+				<< what << std::endl;
+			++failed;
+		}
+	}
+
+	/* ctwz file writes file.cz, ctwz -x file.cz writes file back */
+	void file(const Input &in){
+		fs::remove(in.name + ".cz");
+		write_file(in.name, in.data);
+		if(!run(cat(cat({ctwz}, enc), {in.name}))){
+			return check(false, in, "encode");
+		}
+		fs::remove(in.name);
+		if(!run(cat(cat({ctwz, "-x"}, dec), {in.name + ".cz"}))){
+			return check(false, in, "decode");
+		}
+		check(fs::exists(in.name) && read_file(in.name) == in.data, in, "decoded bytes differ");
+	}
+
+	/* ctwz -c from stdin to stdout and back */
+	void stream(const Input &in){
+		write_file(in.name, in.data);
+		if(!run(cat(cat({ctwz, "-c"}, enc), {}), in.name, in.name + ".cz")){
+			return check(false, in, "encode");
+		}
+		if(!run(cat(cat({ctwz, "-x", "-c"}, dec), {}), in.name + ".cz", in.name + ".out")){
+			return check(false, in, "decode");
+		}
+		check(read_file(in.name + ".out") == in.data, in, "decoded bytes differ");
+	}
+
+	/* Slices of a multi-block file with --range, across and inside blocks */
+	void range(const Input &in){
+		file(in);
+		std::size_t n = in.data.size();
+		if(n == 0){
+			return;
+		}
+		std::vector<std::pair<std::size_t, std::size_t>> slices = {
+			{0, 1}, {0, n}, {n-1, 1}, {n/3, n/2}, {n/2, std::min<std::size_t>(100, n-n/2)}, {n, 0}, 
+			{n/2, SIZE_MAX}};
+		for(auto [off, len] : slices){
+			std::string arg = std::to_string(off) + ":" + std::to_string(len);
+			std::string out = in.name + ".out";
+			bool ok = run(cat(cat({ctwz, "-x", "--range", arg}, dec), {in.name + ".cz"}), 
+					"/dev/null", out);
+			check(ok && read_file(out) == in.data.substr(off, len), in, "--range " + arg);
+		}
+		for(std::string arg : {"1:x", "1:2x", "x:1", "1:-1", "1:99999999999999999999"}){
+			check(!run(cat(cat({ctwz, "-x", "--range", arg}, dec), {in.name + ".cz"})), 
+					in, "--range " + arg + " accepted");
+		}
+	}
+
+	/* Train a dictionary on records like the text and code with it */
+	void dict(const Input &in){
+		if(!fs::exists("test.ctwd")){
+			Rand r;
+			std::vector<std::string> train = {ctwz, "--train", "test.ctwd"};
+			for(int i=0; i<4; ++i){
+				std::string name = "sample" + std::to_string(i);
+				write_file(name, text(3000, r));
+				train.push_back(name);
+			}
+			if(!run(cat(train, enc))){
+				return check(false, in, "--train");
+			}
+		}
+		std::vector<std::string> enc0 = enc, dec0 = dec;
+		enc = cat(enc0, {"-D", "test.ctwd"});
+		dec = cat(dec0, {"-D", "test.ctwd"});
+		file(in);
+		stream(in);
+		enc = enc0;
+		dec = dec0;
+	}
+};
+
+void usage(){
+	std::cout << "ctwz_roundtrip:\n"
+		<< "\tRound trip generated inputs through ctwz\n"
+		<< "usage:\n" 
+		<< "\tctwz_roundtrip ctwz file|stream|range|dict [encoder options] [-- decoder options]" << std::endl;
+	exit(2);
+}
+
+int main(int argc, char* argv[]){
+	if(argc < 3){
+		usage();
+	}
+	Test t;
+	t.ctwz = fs::absolute(argv[1]).string();
+	std::string mode = argv[2];
+	std::vector<std::string>* opts = &t.enc;
+	for(int i=3; i<argc; ++i){
+		if(strcmp(argv[i], "--") == 0){
+			opts = &t.dec;
+		}else{
+			opts->push_back(argv[i]);
+		}
+	}
+	void (Test::*fn)(const Input&) = mode == "file" ? &Test::file : mode == "stream" ? &Test::stream 
+		: mode == "range" ? &Test::range : mode == "dict" ? &Test::dict : nullptr;
+	if(fn == nullptr){
+		usage();
+	}
+	//ctwz -x writes the file named in the header to the working directory
+	fs::path tmp = fs::temp_directory_path() / ("ctwz_roundtrip." + std::to_string(getpid()));
+	fs::create_directories(tmp);
+	fs::current_path(tmp);
+	for(const Input &in : inputs()){
+		(t.*fn)(in);
+	}
+	fs::current_path("/");
+	fs::remove_all(tmp);
+	return t.failed ? 1 : 0;
+}